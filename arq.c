@@ -0,0 +1,111 @@
+#include "arq.h"
+#include "receiver.h"
+#include "sender.h"
+#include "trace.h"
+
+// Selective Repeat: the receiver buffers anything inside its window, so the
+// sender only resends the frame that timed out, and a group frame only to the
+// members that miss it
+static void sr_receive(Receiver* receiver, Frame* frame) {
+    if (within_window(frame->seq_num, receiver->LCA[frame->src_id])) {
+        accept_frame(receiver, frame);
+    }
+}
+
+static int sr_retransmit(Sender* sender, Tx_slot* expired, Frame** outgoing,
+                         int outgoing_count) {
+    if (expired->frame->dst_id == GROUP_DST) {
+        return sender_group_copies(sender, expired, outgoing, outgoing_count);
+    }
+    trace_event(TRACE_FRAME_RETX, sender->send_id, expired->frame->dst_id,
+                expired->frame->seq_num, 1);
+    outgoing[outgoing_count++] = expired->frame;
+    return outgoing_count;
+}
+
+// Go-Back-N: the receiver only takes the next frame in sequence and holds
+// nothing out of order, so on a timeout the sender resends every unacked
+// frame, oldest first
+static void gbn_receive(Receiver* receiver, Frame* frame) {
+    if (frame->seq_num == next_seq(receiver->LCA[frame->src_id])) {
+        accept_frame(receiver, frame);
+    }
+}
+
+static int gbn_retransmit(Sender* sender, Tx_slot* expired, Frame** outgoing,
+                          int outgoing_count) {
+    uint8_t dst_id = expired->frame->dst_id;
+    uint8_t seq_num = sender->LAR[dst_id];
+    while (seq_num != sender->LFS[dst_id]) {
+        seq_num = next_seq(seq_num);
+        Tx_slot* slot = sender_tx_slot(sender, dst_id, seq_num);
+        if (slot->frame != NULL) {
+            trace_event(TRACE_FRAME_RETX, sender->send_id, dst_id, seq_num,
+                        1);
+            outgoing[outgoing_count++] = slot->frame;
+        }
+    }
+    return outgoing_count;
+}
+
+// Datagram: no acks and no retransmissions. Frames are delivered the moment
+// they arrive; a gap in seq_nums means frames were lost, and every message
+// that was part way through on that source is cut short.
+static void dgram_receive(Receiver* receiver, Frame* frame) {
+    uint8_t src_id = frame->src_id;
+    if (frame->stream_id >= MAX_STREAMS) {
+        return;
+    }
+    if (frame->seq_num != next_seq(receiver->LCA[src_id])) {
+        for (int stream_id = 0; stream_id < MAX_STREAMS; stream_id++) {
+            if (receiver->open_streams[src_id] & (1u << stream_id)) {
+                receiver_abort_message(receiver, src_id, stream_id);
+            }
+        }
+        receiver->open_streams[src_id] = 0;
+    }
+    receiver->LCA[src_id] = frame->seq_num;
+
+    uint8_t stream_bit = 1u << frame->stream_id;
+    if (!(frame->flags & FRAME_FIRST) &&
+        !(receiver->open_streams[src_id] & stream_bit)) {
+        // The rest of a message whose start was lost
+        return;
+    }
+    receiver_deliver(receiver, frame);
+    if (frame->flags & FRAME_LAST) {
+        receiver->open_streams[src_id] &= ~stream_bit;
+    } else {
+        receiver->open_streams[src_id] |= stream_bit;
+    }
+}
+
+static int dgram_retransmit(Sender* sender, Tx_slot* expired,
+                            Frame** outgoing, int outgoing_count) {
+    (void) sender;
+    (void) expired;
+    (void) outgoing;
+    return outgoing_count;
+}
+
+enum { ARQ_SELECTIVE_REPEAT, ARQ_GO_BACK_N, ARQ_DATAGRAM, ARQ_MODES };
+
+static const Arq_policy policies[ARQ_MODES] = {
+    [ARQ_SELECTIVE_REPEAT] = {"sr", true, sr_receive, sr_retransmit},
+    [ARQ_GO_BACK_N] = {"gbn", true, gbn_receive, gbn_retransmit},
+    [ARQ_DATAGRAM] = {"dgram", false, dgram_receive, dgram_retransmit},
+};
+
+const Arq_policy* arq_policy() {
+    return &policies[glb_sysconfig.arq_mode];
+}
+
+// Mode index for -mode <name>, or -1
+int arq_parse_mode(const char* name) {
+    for (int i = 0; i < ARQ_MODES; i++) {
+        if (strcmp(name, policies[i].name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
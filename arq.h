@@ -0,0 +1,29 @@
+#ifndef __ARQ_H__
+#define __ARQ_H__
+
+#include "common.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Reliability policy, chosen once at startup with -mode. Framing, CRC,
+// scheduling and the channel are the same for every policy; only what the
+// receiver keeps and what the sender resends differ.
+struct Arq_policy_t {
+    const char* name;
+    // Receivers ack and senders keep frames for retransmission
+    bool acks;
+    // Receiver: take a valid data frame off the channel
+    void (*receive)(Receiver* receiver, Frame* frame);
+    // Sender: append what to resend now that expired has timed out,
+    // returning the new outgoing count
+    int (*retransmit)(Sender* sender, Tx_slot* expired, Frame** outgoing,
+                      int outgoing_count);
+};
+typedef struct Arq_policy_t Arq_policy;
+
+const Arq_policy* arq_policy();
+int arq_parse_mode(const char* name);
+
+#endif
@@ -0,0 +1,126 @@
+import argparse
+import re
+import threading
+import time
+from subprocess import Popen, PIPE, DEVNULL
+
+# Latency benchmark: feeds msg commands into tritontalk at a fixed interval and
+# times each message until its <RECV_x> line shows up on stdout.
+
+BINARY = "./tritontalk"
+FRAME_PAYLOAD_SIZE = 52
+RECV_RE = re.compile(r"<RECV_(\d+)>:\[B(\d+)-")
+
+
+def percentile(values, p):
+    if not values:
+        return float("nan")
+    values = sorted(values)
+    idx = min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))
+    return values[idx]
+
+
+def endpoint_count(extra_args, flag):
+    if flag in extra_args:
+        return int(extra_args[extra_args.index(flag) + 1])
+    return 1
+
+
+def run(extra_args, args):
+    # A config may bring its own -s/-r; message i goes from sender i % s to
+    # receiver i % r
+    senders = endpoint_count(extra_args, "-s")
+    receivers = endpoint_count(extra_args, "-r")
+    cmd = [BINARY, "-s", "1", "-r", "1", "-d", str(args.drop),
+           "-c", str(args.corrupt), "-drain", str(args.timeout)] + extra_args
+    p = Popen(cmd, stdin=PIPE, stdout=PIPE, stderr=DEVNULL, encoding="utf8",
+              bufsize=1)
+
+    sent = {}
+    latencies = {}
+
+    def reader():
+        for line in p.stdout:
+            m = RECV_RE.match(line)
+            if m is None:
+                continue
+            idx = int(m.group(2))
+            if idx in sent and idx not in latencies:
+                latencies[idx] = time.monotonic() - sent[idx]
+
+    t = threading.Thread(target=reader, daemon=True)
+    t.start()
+
+    start = time.monotonic()
+    for i in range(args.messages):
+        body = ("B%d-" % i).ljust(args.size, "x")
+        sent[i] = time.monotonic()
+        p.stdin.write("msg %d %d %s\n" % (i % senders, i % receivers, body))
+        if args.throughput:
+            continue
+        p.stdin.flush()
+        # Open loop: schedule against the start time, not the last write
+        delay = start + (i + 1) * args.interval - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+    p.stdin.flush()
+
+    # exit drains: tritontalk returns once everything is acked (or, in
+    # datagram mode, sent), so the wall clock covers full delivery
+    p.stdin.write("exit\n")
+    p.stdin.flush()
+    p.wait()
+    t.join()
+    elapsed = time.monotonic() - start
+    return [v * 1000 for v in latencies.values()], elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--drop", type=float, default=0.2)
+    parser.add_argument("--corrupt", type=float, default=0.0)
+    parser.add_argument("--messages", type=int, default=200)
+    parser.add_argument("--size", type=int, default=160)
+    parser.add_argument("--interval", type=float, default=0.02)
+    parser.add_argument("--timeout", type=float, default=20.0)
+    parser.add_argument("--throughput", action="store_true",
+                        help="write all messages at once, exit, and report "
+                        "frames/s until fully delivered")
+    parser.add_argument("--config", action="append",
+                        help="name:extra tritontalk args, may be repeated")
+    args = parser.parse_args()
+
+    configs = args.config or ["sr:", "gbn:-mode gbn", "dgram:-mode dgram",
+                              "fec-k4m1:-k 4 -m 1", "fec-k4m2:-k 4 -m 2",
+                              "sr-pipe0:-pipeline 0", "sr-pipe1:-pipeline 1",
+                              "sr-spin:-spin 100 -pin 0",
+                              "sr-pace:-pace auto"]
+    # One sender is capped by its 7-frame window, not by framing, so the
+    # pipeline can only pay off across several senders and enough CPUs
+    if args.throughput and not args.config:
+        configs = ["sr-pipe0:-pipeline 0", "sr-pipe1:-pipeline 1",
+                   "sr-s4-pipe0:-s 4 -r 4 -pipeline 0",
+                   "sr-s4-pipe1:-s 4 -r 4 -pipeline 1"]
+
+    if args.throughput:
+        print("%-12s %9s %9s %12s" % ("config", "delivered", "seconds",
+                                      "frames/s"))
+    else:
+        print("%-12s %9s %9s %9s %9s %9s" %
+              ("config", "delivered", "p50 ms", "p90 ms", "p99 ms", "max ms"))
+    for config in configs:
+        name, _, extra = config.partition(":")
+        lat, elapsed = run(extra.split(), args)
+        if args.throughput:
+            frames = len(lat) * -(-args.size // FRAME_PAYLOAD_SIZE)
+            print("%-12s %5d/%-3d %9.2f %12.0f" %
+                  (name, len(lat), args.messages, elapsed, frames / elapsed))
+            continue
+        print("%-12s %5d/%-3d %9.1f %9.1f %9.1f %9.1f" %
+              (name, len(lat), args.messages, percentile(lat, 50),
+               percentile(lat, 90), percentile(lat, 99),
+               max(lat) if lat else float("nan")))
+
+
+if __name__ == "__main__":
+    main()
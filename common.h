@@ -14,30 +14,33 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "tritontalk.h"
 
 #define MAX_COMMAND_LENGTH 16
-#define AUTOMATED_FILENAME 512
 typedef unsigned char uchar_t;
 
-// System configuration information
-struct SysConfig_t {
-    float drop_prob;
-    float corrupt_prob;
-    unsigned char automated;
-    char automated_file[AUTOMATED_FILENAME];
-};
-typedef struct SysConfig_t SysConfig;
-
 // Command line input information
 struct Cmd_t {
     uint16_t src_id;
     uint16_t dst_id;
     char* message;
+    size_t length; // message may hold binary data, it is not NUL terminated
+    uint8_t priority;
+    uint8_t stream_id;
+    uint32_t msg_id; // per sender, for tracing
+    // Optional bytes sent in front of message, counted in length
+    char* header;
+    size_t header_length;
+    bool mapped; // message is an mmap'd file rather than a malloc'd copy
+    void* user;  // handed back to the sender's on_sent, see sender_submit
 };
 typedef struct Cmd_t Cmd;
 
 // Linked list information
-enum LLtype { llt_string, llt_frame, llt_integer, llt_head } LLtype;
+enum LLtype { llt_string, llt_frame, llt_integer, llt_head };
 
 struct LLnode_t {
     struct LLnode_t* prev;
@@ -50,31 +53,173 @@ typedef struct LLnode_t LLnode;
 
 #define MAX_FRAME_SIZE 64
 #define GENERATOR 9
-// TODO: You should change this!
-// Remember, your frame can be AT MOST 64 bytes!
-#define FRAME_PAYLOAD_SIZE 54
+// Frames live in memory exactly as they go on the wire: one cache line,
+// allocated on a FRAME_ALIGNMENT boundary (see frame_alloc)
+#define FRAME_ALIGNMENT 64
+#define FRAME_HEADER_SIZE 8
+#define FRAME_CRC_SIZE 4
+#define FRAME_PAYLOAD_SIZE                                                     \
+    (MAX_FRAME_SIZE - FRAME_HEADER_SIZE - FRAME_CRC_SIZE)
+
+// Every header field is a single byte, so the layout has no padding and no
+// byte order. The crc is stored big-endian and covers everything before it.
 struct Frame_t {
-    unsigned char src_id;           // 1b
-    unsigned char dst_id;           // 1b
-    unsigned char length;           // 1b
+    uint8_t src_id;                 // 1b
+    uint8_t dst_id;                 // 1b
+    uint8_t length;                 // 1b
     uint8_t seq_num;                // 1b
-    char is_first;                  // 1b
-    char is_last;                   // 1b
+    uint8_t flags;                  // 1b, FRAME_FIRST | FRAME_LAST | prev
+    uint8_t stream_id;              // 1b
+    uint8_t parity;                 // 1b, 0 for data, 1 + stripe for FEC
+    uint8_t window;                 // 1b, ack credits, or FRAME_ACK seq_num
     char data[FRAME_PAYLOAD_SIZE];
-    unsigned int crc;               // 4b
+    uint8_t crc[FRAME_CRC_SIZE];    // 4b
 };
 typedef struct Frame_t Frame;
 
-struct Timed_frame_t {
-    struct timeval timeout;
-    Frame frame;
+_Static_assert(sizeof(Frame) == MAX_FRAME_SIZE, "Frame must fill one line");
+_Static_assert(offsetof(Frame, data) == FRAME_HEADER_SIZE,
+               "Frame header size mismatch");
+_Static_assert(offsetof(Frame, crc) == MAX_FRAME_SIZE - FRAME_CRC_SIZE,
+               "Frame crc must close the frame");
+
+// Frame flags. Bits 2-4 hold how many seq_nums back the previous frame of the
+// same stream is, or 0 when it is at least a window back and so already
+// contiguous at the receiver (see stream_ready).
+#define FRAME_FIRST 0x01
+#define FRAME_LAST 0x02
+#define FRAME_PREV_SHIFT 2
+#define FRAME_PREV_MASK 0x1C
+#define FRAME_GROUP 0x20 // group traffic, see GROUP_DST
+#define FRAME_ACK 0x40   // data frame whose window is a piggybacked ack
+
+// Acks do not take a Frame each. A receiver packs the acks of one pass into
+// channel units of ACKS_PER_UNIT records, and the unit goes to every sender,
+// which picks out the records addressed to it. Each record carries its own
+// 16-bit check (the low half of the CRC-32 over the bytes before it, xored
+// with ACK_CRC_XOR and stored big-endian), so one corrupted record does not
+// void the rest of its unit.
+// src_id, dst_id and seq_num sit where they do in a Frame, so the channel and
+// the trace can read a unit's first record as a frame header. Unused records
+// are zero and fail the check.
+struct Ack_t {
+    uint8_t src_id;  // sender being acked
+    uint8_t dst_id;  // receiver that acks
+    uint8_t sack;    // bit i: seq_num + 2 + i is held out of order
+    uint8_t seq_num; // cumulative ack
+    uint8_t flags;   // FRAME_GROUP
+    uint8_t window;  // credits
+    uint8_t crc[2];
+};
+typedef struct Ack_t Ack;
+
+#define ACK_CRC_SIZE 2
+// The channel corrupts by flipping whole bytes, so an unused record can turn
+// into 0x00/0xFF bytes throughout. The CRC is linear: with ~ (0xFFFF) as the
+// constant, a zero record with both check bytes flipped passed as an ack of
+// seq_num 0. No byte-flip pattern of a zero record matches under this one.
+#define ACK_CRC_XOR 0xA5C3
+#define ACKS_PER_UNIT (MAX_FRAME_SIZE / sizeof(Ack))
+_Static_assert(offsetof(Ack, seq_num) == offsetof(Frame, seq_num) &&
+                   offsetof(Ack, dst_id) == offsetof(Frame, dst_id),
+               "Ack records must line up with the frame header");
+
+// Single producer, single consumer queue of frames. head and tail sit on
+// separate cache lines so the two threads do not false share.
+// The framer keeps at most FRAME_LOOKAHEAD frames, one full send window, in
+// it: frames are numbered when cut, so anything deeper would hold up priority
+// messages that arrive later.
+#define FRAME_RING_SIZE 8 // must be a power of two
+#define FRAME_LOOKAHEAD (WINDOW_SIZE - 1)
+struct Frame_ring_t {
+    atomic_size_t head;
+    char pad[64 - sizeof(atomic_size_t)];
+    atomic_size_t tail;
+    Frame* slots[FRAME_RING_SIZE];
 };
+typedef struct Frame_ring_t Frame_ring;
 
-typedef struct Timed_frame_t Timed_frame;
+// One bit per sequence number. seq_num 0 is never used and always reads as
+// set, so gap searches skip it the same way next_seq does.
+#define SEQ_BITMAP_WORDS ((UINT8_MAX + 1) / 64)
+struct Seq_bitmap_t {
+    uint64_t words[SEQ_BITMAP_WORDS];
+};
+typedef struct Seq_bitmap_t Seq_bitmap;
+
+// xoshiro256** state, see rng_next
+struct Rng_t {
+    uint64_t s[4];
+};
+typedef struct Rng_t Rng;
+
+// A sent frame waiting for its ack, and when to retransmit it
+struct Tx_slot_t {
+    Frame* frame; // NULL when the slot is free
+    struct timeval timeout;
+    uint16_t pending; // group frames: bit per receiver yet to ack
+    uint8_t link;     // link of the last transmission
+    uint8_t sends;    // transmissions so far, RTT is only sampled after one
+    bool sacked;      // the receiver holds it out of order, see Ack.sack
+};
+typedef struct Tx_slot_t Tx_slot;
 
 #define MAX_CLIENTS 10
 #define WINDOW_SIZE 8
 
+// Group sends go to every receiver through one extra destination per sender,
+// framed and sent once. Receivers keep a sender's group traffic apart from its
+// unicast traffic by filing it under src_id + MAX_CLIENTS, so per-source
+// receiver state is sized MAX_PEERS.
+#define GROUP_DST MAX_CLIENTS
+#define MAX_DESTS (MAX_CLIENTS + 1)
+#define MAX_PEERS (2 * MAX_CLIENTS)
+_Static_assert(MAX_CLIENTS <= 16, "Tx_slot.pending is 16 bits");
+_Static_assert(WINDOW_SIZE <= (FRAME_PREV_MASK >> FRAME_PREV_SHIFT) + 1,
+               "Stream back references must span the window");
+
+// Logical streams per sender/receiver pair. Streams share the sequence space,
+// window and acks, but are ordered independently at the receiver.
+#define MAX_STREAMS 8
+#define STREAM_DEFAULT 0
+_Static_assert(MAX_STREAMS <= 8, "open_streams is one byte per source");
+
+// Sender scheduling: message classes, framed in order of priority within a
+// destination, and the deficit round robin quantum across destinations
+#define NUM_PRIORITIES 3
+#define PRIO_HIGH 0
+#define PRIO_NORMAL 1
+#define PRIO_BULK 2
+#define SCHED_QUANTUM FRAME_PAYLOAD_SIZE
+// Frames a receiver is willing to hold, queued plus buffered out of order
+#define RECV_QUEUE_LIMIT (4 * WINDOW_SIZE)
+
+// Forward error correction limits (see fec.c)
+#define FEC_MAX_GROUP_SIZE 16
+#define FEC_MAX_PARITY 4
+
+struct Receiver_t;
+
+// Called by a receiver thread for every frame of payload as soon as it is in
+// order within its stream; frames of different streams may interleave.
+// is_last marks the final chunk of a message. src_id is past MAX_CLIENTS for
+// group messages (see GROUP_DST). data is NULL when the rest of
+// the message was lost (datagram mode) and what was collected should be
+// dropped. Runs on the receiver thread with its buffer_mutex held.
+typedef void (*Recv_callback)(struct Receiver_t* receiver, uint8_t src_id,
+                              uint8_t stream_id, const char* data,
+                              size_t length, bool is_last, void* ctx);
+
+struct Sender_t;
+
+// Called by a sender thread once dst_id has acked the last frame of a
+// message, or in datagram mode once it has been sent, with the user pointer
+// the message was submitted with. acked is false for messages still pending
+// at shutdown (see sender_cancel_pending). Runs on the sender thread with its
+// buffer_mutex held.
+typedef void (*Send_callback)(struct Sender_t* sender, uint16_t dst_id,
+                              void* user, bool acked, void* ctx);
+
 // Receiver and sender data structures
 struct Receiver_t {
     // DO NOT CHANGE:
@@ -86,9 +231,44 @@ struct Receiver_t {
     pthread_cond_t buffer_cv;
     LLnode* input_framelist_head;
     int recv_id;
+    bool stop; // set by main to end run_receiver
     LLnode** ingoing_frames_head_ptr_map;
-    Frame* frame_buffer[MAX_CLIENTS][UINT8_MAX];
-    uint8_t LCA[MAX_CLIENTS];
+    Frame* frame_buffer[MAX_PEERS][UINT8_MAX + 1];
+    // Bit set for every seq_num received past the LCA, and for those of them
+    // still held in frame_buffer waiting for an earlier frame of their stream
+    Seq_bitmap recv_map[MAX_PEERS];
+    Seq_bitmap undelivered[MAX_PEERS];
+    uint8_t LCA[MAX_PEERS];
+
+    // Delivery of in-order payload, print_message by default
+    Recv_callback on_data;
+    void* on_data_ctx;
+    // Partial messages reassembled by print_message
+    char* msg_buffer[MAX_PEERS][MAX_STREAMS];
+    size_t msg_length[MAX_PEERS][MAX_STREAMS];
+    size_t msg_capacity[MAX_PEERS][MAX_STREAMS];
+    // Complete messages handed to on_data, per source
+    uint32_t msgs_delivered[MAX_PEERS];
+    // Datagram mode: bit per stream with a message part way through
+    uint8_t open_streams[MAX_PEERS];
+    // Open file transfer per stream, see file.c
+    struct File_sink_t* file_sink[MAX_PEERS][MAX_STREAMS];
+
+    // Duplex: bit per source owed an ack that may still ride on a data frame
+    // of this host's sender, when it falls due and how many frames it
+    // covers. Acks found on incoming data frames wait in host_acks until
+    // they are handed to this host's sender.
+    uint16_t acks_owed;
+    struct timeval ack_due[MAX_CLIENTS];
+    uint8_t ack_frames[MAX_CLIENTS];
+    LLnode* host_acks;
+    uint32_t acks_sent;        // ack records put on the channel
+    uint32_t ack_units;        // channel units they were packed into
+    uint32_t acks_piggybacked; // acks carried by data frames instead
+
+    // FEC: copies of accepted frames and pending parity, indexed by seq_num
+    Frame* fec_shadow[MAX_PEERS][UINT8_MAX + 1];
+    Frame* fec_parity[MAX_PEERS][UINT8_MAX + 1];
 };
 
 struct Sender_t {
@@ -103,20 +283,100 @@ struct Sender_t {
     LLnode* input_cmdlist_head;
     LLnode* input_framelist_head;
     uint8_t send_id;
+    uint32_t next_msg_id;
+    // Backpressure: commands and bytes accepted but not framed yet, and their
+    // high-water marks. Callers wait on space_cv while either budget is
+    // used up. The framing thread counts what it takes off in unqueued_*
+    // and settles it under buffer_mutex, see sender_release_queue.
+    pthread_cond_t space_cv;
+    uint32_t queued_cmds;
+    size_t queued_bytes;
+    uint32_t queued_cmds_peak;
+    size_t queued_bytes_peak;
+    uint32_t queue_stalls; // commands that had to wait for room
+    uint32_t unqueued_cmds;
+    size_t unqueued_bytes;
+    // Shutdown: draining refuses new commands, stop ends the threads
+    bool draining;
+    bool stop;
+    bool framing; // framer is cutting frames outside buffer_mutex
+
+    // Framing stage, run by the framer thread when pipelined: per-destination
+    // queues of Cmd, one per priority class, the message each class is
+    // currently cutting into frames and the seq_num of the last frame cut
+    pthread_cond_t framer_cv;
+    LLnode* cmd_queue[MAX_DESTS][NUM_PRIORITIES];
+    Cmd* current_cmd[MAX_DESTS][NUM_PRIORITIES];
+    size_t current_offset[MAX_DESTS][NUM_PRIORITIES];
+    uint8_t frame_seq[MAX_DESTS];
+    // Frames cut per destination, and that count as of the last frame cut on
+    // each stream (0 for none), to find a frame's predecessor in its stream
+    uint32_t frames_cut[MAX_DESTS];
+    uint32_t stream_last[MAX_DESTS][MAX_STREAMS];
+
+    // Framed frames handed from the framing to the transmit stage
+    Frame_ring framed[MAX_DESTS];
+
+    // Transmit stage scheduling
+    int deficit[MAX_DESTS];
+    int rr_next;
+
+    // Unacked frames, see sender_tx_slot
+    Tx_slot tx_slots[MAX_DESTS][WINDOW_SIZE];
+    uint8_t LAR[MAX_DESTS];
+    uint8_t LFS[MAX_DESTS];
+    // Bit set for every seq_num sent and not yet acked
+    Seq_bitmap unacked[MAX_DESTS];
+
+    // Flow control: credits advertised by each receiver, AIMD congestion
+    // window and the LFS at the last window reduction
+    uint8_t rwnd[MAX_DESTS];
+    double cwnd[MAX_DESTS];
+    uint8_t cwnd_recover[MAX_DESTS];
+
+    // Group sends: bit per member receiver, and the cumulative ack and
+    // credits each one last reported. LAR[GROUP_DST] trails the slowest.
+    uint16_t group_members;
+    uint8_t group_acked[MAX_CLIENTS];
+    uint8_t group_rwnd[MAX_CLIENTS];
+    uint32_t group_msgs; // group messages accepted, for the drain report
+
+    // Multipath: loss rate and RTT (usec) estimated per link from this
+    // sender's acks and timeouts, weighted round robin credit and frames sent.
+    // Only touched by the sender thread.
+    double link_loss[MAX_LINKS];
+    double link_rtt[MAX_LINKS];
+    double link_credit[MAX_LINKS];
+    uint32_t link_frames[MAX_LINKS];
+
+    // Pacing: token bucket per destination holding up to PACE_BURST frames,
+    // refilled at -pace frames/s or, with -pace auto, at cwnd per smoothed
+    // RTT (usec). Only touched by the sender thread.
+    double pace_tokens[MAX_DESTS];
+    struct timeval pace_stamp[MAX_DESTS];
+    double srtt[MAX_DESTS];
 
-    LLnode* frame_buffer[MAX_CLIENTS];
+    // Completions, only kept while on_sent is set: per destination, the
+    // seq_num of each message's last frame and its user pointer, in the order
+    // they were cut. The framer appends under done_mutex before the frame
+    // can go out, the sender thread pops them as acks come in.
+    Send_callback on_sent;
+    void* on_sent_ctx;
+    pthread_mutex_t done_mutex;
+    LLnode* done[MAX_DESTS];
 
-    LLnode* timeout;
-    uint8_t LAR[MAX_CLIENTS];
-    uint8_t LFS[MAX_CLIENTS];
+    // FEC: one parity accumulator per stripe and the next seq_num to encode
+    Frame fec_acc[MAX_DESTS][FEC_MAX_PARITY];
+    uint8_t fec_next[MAX_DESTS];
+    bool fec_dirty[MAX_DESTS];
 };
 
-enum SendFrame_DstType { ReceiverDst, SenderDst } SendFrame_DstType;
+enum SendFrame_DstType { ReceiverDst, SenderDst };
 
 typedef struct Sender_t Sender;
 typedef struct Receiver_t Receiver;
 
-// Declare global variables here
+// Declare global variables here, they are defined in tritontalk.c
 // DO NOT CHANGE:
 //   1) glb_senders_array
 //   2) glb_receivers_array
@@ -124,11 +384,11 @@ typedef struct Receiver_t Receiver;
 //   4) glb_receivers_array_length
 //   5) glb_sysconfig
 //   6) CORRUPTION_BITS
-Sender* glb_senders_array;
-Receiver* glb_receivers_array;
-int glb_senders_array_length;
-int glb_receivers_array_length;
-SysConfig glb_sysconfig;
-int CORRUPTION_BITS;
+extern Sender* glb_senders_array;
+extern Receiver* glb_receivers_array;
+extern int glb_senders_array_length;
+extern int glb_receivers_array_length;
+extern SysConfig glb_sysconfig;
+extern int CORRUPTION_BITS;
 
 #endif
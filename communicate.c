@@ -1,38 +1,147 @@
 #include "communicate.h"
+#include "perf.h"
+#include "simd.h"
+#include "trace.h"
+
+#include <stdatomic.h>
+
+// Impairments are drawn per link rather than from rand(): every sender
+// transmits data on its own links (link_count of them, each with its own drop
+// and corrupt rates) and every receiver sends acks on its own, so each
+// generator has a single owner thread and needs no lock. Decisions are drawn
+// IMPAIR_BATCH at a time and the channel just consumes them. The rates are
+// atomic so channel_set_impairments can change them under a running link;
+// the new rates apply from the link's next batch.
+#define IMPAIR_BATCH 64
+#define IMPAIR_DROP 1
+#define IMPAIR_CORRUPT 2
+
+struct Link_t {
+    Rng rng;
+    _Atomic float drop_prob;
+    _Atomic float corrupt_prob;
+    uint8_t decisions[IMPAIR_BATCH];
+    int next;
+};
+typedef struct Link_t Link;
+
+static Link data_links[MAX_CLIENTS][MAX_LINKS];
+static Link ack_links[MAX_CLIENTS];
+
+void channel_seed(uint64_t seed) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        // Link 0 keeps the seed it had before there were several
+        for (int l = 0; l < MAX_LINKS; l++) {
+            Link* link = &data_links[i][l];
+            rng_seed(&link->rng, seed + 2 * i + 2 * MAX_CLIENTS * l);
+            link->drop_prob = glb_sysconfig.link_drop[l];
+            link->corrupt_prob = glb_sysconfig.link_corrupt[l];
+            link->next = IMPAIR_BATCH;
+        }
+        rng_seed(&ack_links[i].rng, seed + 2 * i + 1);
+        ack_links[i].drop_prob = glb_sysconfig.drop_prob;
+        ack_links[i].corrupt_prob = glb_sysconfig.corrupt_prob;
+        ack_links[i].next = IMPAIR_BATCH;
+    }
+}
+
+// Give every link the same rates, overriding -link
+void channel_set_impairments(float drop_prob, float corrupt_prob) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        for (int l = 0; l < MAX_LINKS; l++) {
+            atomic_store_explicit(&data_links[i][l].drop_prob, drop_prob,
+                                  memory_order_relaxed);
+            atomic_store_explicit(&data_links[i][l].corrupt_prob,
+                                  corrupt_prob, memory_order_relaxed);
+        }
+        atomic_store_explicit(&ack_links[i].drop_prob, drop_prob,
+                              memory_order_relaxed);
+        atomic_store_explicit(&ack_links[i].corrupt_prob, corrupt_prob,
+                              memory_order_relaxed);
+    }
+}
+
+// Probability as a threshold on the top 32 bits of a draw
+static uint64_t impair_threshold(float prob) {
+    return (uint64_t) ((double) prob * 4294967296.0);
+}
+
+static void link_refill(Link* link) {
+    uint64_t drop = impair_threshold(
+        atomic_load_explicit(&link->drop_prob, memory_order_relaxed));
+    uint64_t corrupt = impair_threshold(
+        atomic_load_explicit(&link->corrupt_prob, memory_order_relaxed));
+    for (int i = 0; i < IMPAIR_BATCH; i++) {
+        uint64_t r = rng_next(&link->rng);
+        link->decisions[i] = ((r >> 32) < drop ? IMPAIR_DROP : 0) |
+                             ((r & 0xFFFFFFFF) < corrupt ? IMPAIR_CORRUPT : 0);
+    }
+    link->next = 0;
+}
+
+static uint8_t link_decision(Link* link) {
+    if (link->next == IMPAIR_BATCH) {
+        link_refill(link);
+    }
+    return link->decisions[link->next++];
+}
+
+// Data frames travel on one of their sender's links, acks on their
+// receiver's
+static Link* frame_link(char* char_buffer, enum SendFrame_DstType dst_type,
+                        int link) {
+    Frame* frame = (Frame*) char_buffer;
+    if (dst_type == ReceiverDst) {
+        return &data_links[frame->src_id % MAX_CLIENTS][link % MAX_LINKS];
+    }
+    return &ack_links[frame->dst_id % MAX_CLIENTS];
+}
+
+// Flip CORRUPTION_BITS random bytes. Every receiver sees the same corruption,
+// so the mask is applied once before the frame is copied out.
+static void link_corrupt(Link* link, char* char_buffer) {
+    uint8_t corrupt_mask[MAX_FRAME_SIZE] = {0};
+    uint64_t r = 0;
+    int left = 0;
+    for (int i = 0; i < CORRUPTION_BITS; i++) {
+        // Ten 6-bit indices per draw
+        if (left == 0) {
+            r = rng_next(&link->rng);
+            left = 10;
+        }
+        corrupt_mask[r % MAX_FRAME_SIZE] ^= 0xFF;
+        r /= MAX_FRAME_SIZE;
+        left--;
+    }
+    frame_xor_mask(char_buffer, corrupt_mask);
+}
 
 //*********************************************************************
 // NOTE: We will overwrite this file, so whatever changes you put here
 //      WILL NOT persist
 //*********************************************************************
-void send_frame(char* char_buffer, enum SendFrame_DstType dst_type) {
-    int i = 0, j;
+static void channel_send(char* char_buffer, enum SendFrame_DstType dst_type,
+                         int link_idx) {
+    int i = 0;
     char* per_recv_char_buffer;
+    Link* link = frame_link(char_buffer, dst_type, link_idx);
+    uint8_t decision = link_decision(link);
 
-    // Multiply out the probabilities to some degree of precision
-    int prob_prec = 1000;
-    int drop_prob = (int) prob_prec * glb_sysconfig.drop_prob;
-    int corrupt_prob = (int) prob_prec * glb_sysconfig.corrupt_prob;
-    int num_corrupt_bits = CORRUPTION_BITS;
-    int corrupt_indices[num_corrupt_bits];
-
-    // Pick a random number
-    int random_num = rand() % prob_prec;
-    int random_index;
+    Frame* frame = (Frame*) char_buffer;
+    bool is_ack = dst_type == SenderDst;
 
     // Drop the packet on the floor
-    if (random_num < drop_prob) {
+    if (decision & IMPAIR_DROP) {
+        trace_event(TRACE_FRAME_DROPPED, frame->src_id, frame->dst_id,
+                    frame->seq_num, is_ack);
         free(char_buffer);
         return;
     }
 
-    // Determine whether to corrupt bits
-    random_num = rand() % prob_prec;
-    if (random_num < corrupt_prob) {
-        // Pick random indices to corrupt
-        for (i = 0; i < num_corrupt_bits; i++) {
-            random_index = rand() % MAX_FRAME_SIZE;
-            corrupt_indices[i] = random_index;
-        }
+    if (decision & IMPAIR_CORRUPT) {
+        trace_event(TRACE_FRAME_CORRUPTED, frame->src_id, frame->dst_id,
+                    frame->seq_num, is_ack);
+        link_corrupt(link, char_buffer);
     }
 
     // Determine the array size of the destination objects
@@ -46,20 +155,10 @@ void send_frame(char* char_buffer, enum SendFrame_DstType dst_type) {
     // Go through the dst array and add the packet to their receive queues
     for (i = 0; i < array_length; i++) {
         // Allocate a per receiver char buffer for the message
-        per_recv_char_buffer = (char*) malloc(sizeof(char) * MAX_FRAME_SIZE);
+        per_recv_char_buffer =
+            (char*) aligned_alloc(FRAME_ALIGNMENT, MAX_FRAME_SIZE);
         memcpy(per_recv_char_buffer, char_buffer, MAX_FRAME_SIZE);
 
-        // Corrupt the bits (inefficient, should just corrupt one copy and
-        // memcpy it
-        if (random_num < corrupt_prob) {
-            // Corrupt bits at the chosen random indices
-            for (j = 0; j < num_corrupt_bits; j++) {
-                random_index = corrupt_indices[j];
-                per_recv_char_buffer[random_index] =
-                    ~per_recv_char_buffer[random_index];
-            }
-        }
-
         if (dst_type == ReceiverDst) {
             Receiver* dst = &glb_receivers_array[i];
             pthread_mutex_lock(&dst->buffer_mutex);
@@ -81,6 +180,23 @@ void send_frame(char* char_buffer, enum SendFrame_DstType dst_type) {
     return;
 }
 
+static void send_frame_on(char* char_buffer, enum SendFrame_DstType dst_type,
+                          int link_idx) {
+    Perf_sample sample;
+    perf_begin(&sample);
+    channel_send(char_buffer, dst_type, link_idx);
+    perf_end(PERF_SEND_FRAME, &sample, 1);
+}
+
+void send_frame(char* char_buffer, enum SendFrame_DstType dst_type) {
+    send_frame_on(char_buffer, dst_type, 0);
+}
+
+// Same as send_msg_to_receivers on one of the sender's link_count links
+void send_msg_on_link(char* char_buffer, int link) {
+    send_frame_on(char_buffer, ReceiverDst, link);
+}
+
 // NOTE: You should use the following method to transmit messages from senders
 // to receivers
 void send_msg_to_receivers(char* char_buffer) {
@@ -15,7 +15,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+void channel_seed(uint64_t seed);
+void channel_set_impairments(float drop_prob, float corrupt_prob);
 void send_msg_to_receivers(char*);
+void send_msg_on_link(char* char_buffer, int link);
 void send_msg_to_senders(char*);
 void send_frame(char*, enum SendFrame_DstType);
 
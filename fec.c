@@ -0,0 +1,219 @@
+#include "fec.h"
+#include <stddef.h>
+
+// Frames are grouped by sequence number: group g holds the K frames with
+// seq_num in [g * K + 1, g * K + K] (seq 0 is never used, and the last group
+// before the wrap point is truncated at UINT8_MAX). Within a group, frame i
+// belongs to stripe i % M and every stripe gets its own XOR parity frame.
+// A parity frame carries the last seq_num it covers, so a group can be
+// flushed early when the sender goes idle.
+
+bool fec_enabled() {
+    return glb_sysconfig.fec_group_size > 0 &&
+           glb_sysconfig.fec_parity_count > 0;
+}
+
+uint8_t fec_group_base(uint8_t seq_num) {
+    int k = glb_sysconfig.fec_group_size;
+    return ((seq_num - 1) / k) * k + 1;
+}
+
+uint8_t fec_group_end(uint8_t seq_num) {
+    int end = fec_group_base(seq_num) + glb_sysconfig.fec_group_size - 1;
+    return end > UINT8_MAX ? UINT8_MAX : end;
+}
+
+static int fec_stripe(uint8_t seq_num) {
+    return (seq_num - fec_group_base(seq_num)) %
+           glb_sysconfig.fec_parity_count;
+}
+
+// XOR everything in front of the crc. Header fields that are not protected
+// (src_id, dst_id, seq_num, parity) are overwritten after the fact.
+static void fec_xor_frame(Frame* acc, Frame* frame) {
+    char* dst = (char*) acc;
+    char* src = (char*) frame;
+    for (size_t i = 0; i < offsetof(Frame, crc); i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+void fec_init_sender(Sender* sender) {
+    for (int i = 0; i < MAX_DESTS; i++) {
+        memset(sender->fec_acc[i], 0, sizeof(sender->fec_acc[i]));
+        sender->fec_next[i] = next_seq(0);
+        sender->fec_dirty[i] = false;
+    }
+}
+
+static void fec_emit(Sender* sender, uint8_t dst_id, uint8_t last_seq,
+                     LLnode** parity_head_ptr) {
+    uint8_t base = fec_group_base(last_seq);
+    for (int j = 0; j < glb_sysconfig.fec_parity_count; j++) {
+        // Stripe has no members yet
+        if (base + j > last_seq) {
+            break;
+        }
+        Frame* parity = copy_frame(&sender->fec_acc[dst_id][j]);
+        parity->src_id = sender->send_id;
+        parity->dst_id = dst_id;
+        parity->seq_num = last_seq;
+        parity->parity = j + 1;
+        frame_seal(parity);
+        ll_append_node(parity_head_ptr, parity);
+    }
+    sender->fec_dirty[dst_id] = false;
+}
+
+// Fold a frame that is about to be transmitted for the first time into the
+// parity accumulators. Retransmissions are ignored since they are already
+// covered.
+void fec_encode_frame(Sender* sender, Frame* frame, LLnode** parity_head_ptr) {
+    uint8_t dst_id = frame->dst_id;
+    if (frame->parity != 0 || frame->seq_num != sender->fec_next[dst_id]) {
+        return;
+    }
+
+    uint8_t base = fec_group_base(frame->seq_num);
+    if (frame->seq_num == base) {
+        memset(sender->fec_acc[dst_id], 0, sizeof(sender->fec_acc[dst_id]));
+    }
+    fec_xor_frame(&sender->fec_acc[dst_id][fec_stripe(frame->seq_num)], frame);
+    sender->fec_next[dst_id] = next_seq(frame->seq_num);
+    sender->fec_dirty[dst_id] = true;
+
+    if (frame->seq_num == fec_group_end(frame->seq_num)) {
+        fec_emit(sender, dst_id, frame->seq_num, parity_head_ptr);
+    }
+}
+
+// Emit parity for a partially filled group, used when nothing else is queued
+// for dst_id so the tail of a message is still protected
+void fec_flush(Sender* sender, uint8_t dst_id, LLnode** parity_head_ptr) {
+    if (sender->fec_dirty[dst_id]) {
+        fec_emit(sender, dst_id, prev_seq(sender->fec_next[dst_id]),
+                 parity_head_ptr);
+    }
+}
+
+void fec_init_receiver(Receiver* receiver) {
+    for (int i = 0; i < MAX_PEERS; i++) {
+        for (int j = 0; j <= UINT8_MAX; j++) {
+            receiver->fec_shadow[i][j] = NULL;
+            receiver->fec_parity[i][j] = NULL;
+        }
+    }
+}
+
+void fec_destroy_receiver(Receiver* receiver) {
+    for (int i = 0; i < MAX_PEERS; i++) {
+        for (int j = 0; j <= UINT8_MAX; j++) {
+            free(receiver->fec_shadow[i][j]);
+            free(receiver->fec_parity[i][j]);
+        }
+    }
+    fec_init_receiver(receiver);
+}
+
+// Keep a copy of every accepted data frame until its whole group has been
+// acknowledged, even after the frame itself has been delivered
+void fec_store_frame(Receiver* receiver, Frame* frame) {
+    if (receiver->fec_shadow[frame->src_id][frame->seq_num] == NULL) {
+        receiver->fec_shadow[frame->src_id][frame->seq_num] =
+            copy_frame(frame);
+    }
+}
+
+// Parity for stripe j of the group starting at base is kept at index base + j.
+// A later parity for the same stripe covers more frames and replaces it.
+void fec_store_parity(Receiver* receiver, Frame* parity) {
+    // Everything this parity covers has already been acknowledged
+    if (!within_window(parity->seq_num, receiver->LCA[parity->src_id])) {
+        return;
+    }
+
+    uint8_t idx = fec_group_base(parity->seq_num) + parity->parity - 1;
+    Frame** slot = &receiver->fec_parity[parity->src_id][idx];
+
+    if (*slot != NULL) {
+        if ((*slot)->seq_num >= parity->seq_num) {
+            return;
+        }
+        free(*slot);
+    }
+    *slot = copy_frame(parity);
+}
+
+// Try to rebuild one missing frame of the group containing seq_num. Returns a
+// newly allocated frame, or NULL if no stripe is missing exactly one frame.
+Frame* fec_recover(Receiver* receiver, uint8_t src_id, uint8_t seq_num) {
+    uint8_t base = fec_group_base(seq_num);
+
+    for (int j = 0; j < glb_sysconfig.fec_parity_count; j++) {
+        if (base + j > UINT8_MAX) {
+            break;
+        }
+        Frame* parity = receiver->fec_parity[src_id][base + j];
+        if (parity == NULL) {
+            continue;
+        }
+
+        int missing = 0;
+        uint8_t missing_seq = 0;
+        for (int s = base + j; s <= parity->seq_num;
+             s += glb_sysconfig.fec_parity_count) {
+            if (receiver->fec_shadow[src_id][s] == NULL) {
+                missing++;
+                missing_seq = s;
+            }
+        }
+
+        if (missing == 0) {
+            free(parity);
+            receiver->fec_parity[src_id][base + j] = NULL;
+            continue;
+        }
+        if (missing > 1 ||
+            !within_window(missing_seq, receiver->LCA[src_id])) {
+            continue;
+        }
+
+        Frame* rebuilt = copy_frame(parity);
+        for (int s = base + j; s <= parity->seq_num;
+             s += glb_sysconfig.fec_parity_count) {
+            if (s != missing_seq) {
+                fec_xor_frame(rebuilt, receiver->fec_shadow[src_id][s]);
+            }
+        }
+        rebuilt->src_id = src_id;
+        rebuilt->dst_id = parity->dst_id;
+        rebuilt->seq_num = missing_seq;
+        rebuilt->parity = 0;
+        frame_seal(rebuilt);
+        return rebuilt;
+    }
+    return NULL;
+}
+
+static void fec_retire_group(Receiver* receiver, uint8_t src_id,
+                             uint8_t base) {
+    uint8_t end = fec_group_end(base);
+    for (int s = base; s <= end; s++) {
+        free(receiver->fec_shadow[src_id][s]);
+        receiver->fec_shadow[src_id][s] = NULL;
+        free(receiver->fec_parity[src_id][s]);
+        receiver->fec_parity[src_id][s] = NULL;
+    }
+}
+
+// Drop the state of every group whose last frame has been passed by the LCA
+void fec_retire(Receiver* receiver, uint8_t src_id, uint8_t old_LCA,
+                uint8_t new_LCA) {
+    uint8_t seq = old_LCA;
+    while (seq != new_LCA) {
+        seq = next_seq(seq);
+        if (seq == fec_group_end(seq)) {
+            fec_retire_group(receiver, src_id, fec_group_base(seq));
+        }
+    }
+}
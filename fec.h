@@ -0,0 +1,30 @@
+#ifndef __FEC_H__
+#define __FEC_H__
+
+#include "common.h"
+#include "util.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool fec_enabled();
+
+uint8_t fec_group_base(uint8_t seq_num);
+uint8_t fec_group_end(uint8_t seq_num);
+
+// Sender side
+void fec_init_sender(Sender* sender);
+void fec_encode_frame(Sender* sender, Frame* frame, LLnode** parity_head_ptr);
+void fec_flush(Sender* sender, uint8_t dst_id, LLnode** parity_head_ptr);
+
+// Receiver side
+void fec_init_receiver(Receiver* receiver);
+void fec_destroy_receiver(Receiver* receiver);
+void fec_store_frame(Receiver* receiver, Frame* frame);
+void fec_store_parity(Receiver* receiver, Frame* parity);
+Frame* fec_recover(Receiver* receiver, uint8_t src_id, uint8_t seq_num);
+void fec_retire(Receiver* receiver, uint8_t src_id, uint8_t old_LCA,
+                uint8_t new_LCA);
+
+#endif
@@ -0,0 +1,192 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "file.h"
+#include "sender.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+struct File_sink_t {
+    int fd;
+    char* path;
+    uint64_t size;
+    uint32_t crc;
+    uint64_t offset;
+    struct timeval start;
+};
+typedef struct File_sink_t File_sink;
+
+static void put_be(char* buf, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        buf[i] = (char) (value & 0xFF);
+        value >>= 8;
+    }
+}
+
+static uint64_t get_be(const char* buf, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | (uint8_t) buf[i];
+    }
+    return value;
+}
+
+// Map path and queue it for dst_id. The mapping is framed directly and
+// unmapped by the sender once the last frame is cut.
+int sender_send_file(Sender* sender, uint16_t dst_id, const char* path,
+                     const char* out_path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s is not a regular file\n", path);
+        close(fd);
+        return -1;
+    }
+
+    size_t size = st.st_size;
+    char* mapping = NULL;
+    if (size > 0) {
+        mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            fprintf(stderr, "Cannot map %s\n", path);
+            close(fd);
+            return -1;
+        }
+        posix_madvise(mapping, size, POSIX_MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    size_t path_len = strlen(out_path);
+    if (path_len > UINT16_MAX) {
+        fprintf(stderr, "Output path is too long\n");
+        if (mapping != NULL) {
+            munmap(mapping, size);
+        }
+        return -1;
+    }
+    char* header = malloc(FILE_HEADER_SIZE + path_len);
+    memcpy(header, FILE_MAGIC, FILE_MAGIC_SIZE);
+    put_be(header + 8, size, 8);
+    put_be(header + 16, size > 0 ? crc_buffer(mapping, size) : 0, 4);
+    put_be(header + 20, path_len, 2);
+    memcpy(header + FILE_HEADER_SIZE, out_path, path_len);
+
+    return sender_send_mapped(sender, dst_id, FILE_STREAM, header,
+                              FILE_HEADER_SIZE + path_len, mapping, size,
+                              PRIO_BULK);
+}
+
+// Whether the first length bytes of a message could be a file header
+bool file_header_started(const char* buf, size_t length) {
+    size_t n = length < FILE_MAGIC_SIZE ? length : FILE_MAGIC_SIZE;
+    return memcmp(buf, FILE_MAGIC, n) == 0;
+}
+
+// Full header length, or 0 while it has not all arrived yet
+size_t file_header_length(const char* buf, size_t length) {
+    if (length < FILE_HEADER_SIZE) {
+        return 0;
+    }
+    size_t total = FILE_HEADER_SIZE + get_be(buf + 20, 2);
+    return length >= total ? total : 0;
+}
+
+// Files may only land below the receiver's working directory: no absolute
+// paths and no ".." components
+static bool file_path_allowed(const char* path) {
+    if (path[0] == '\0' || path[0] == '/') {
+        return false;
+    }
+    const char* part = path;
+    while (part != NULL) {
+        if (part[0] == '.' && part[1] == '.' &&
+            (part[2] == '/' || part[2] == '\0')) {
+            return false;
+        }
+        part = strchr(part, '/');
+        if (part != NULL) {
+            part++;
+        }
+    }
+    return true;
+}
+
+File_sink* file_sink_open(Receiver* receiver, uint8_t src_id,
+                          const char* header) {
+    size_t path_len = get_be(header + 20, 2);
+    File_sink* sink = calloc(1, sizeof(File_sink));
+    sink->path = malloc(path_len + 1);
+    memcpy(sink->path, header + FILE_HEADER_SIZE, path_len);
+    sink->path[path_len] = '\0';
+    sink->size = get_be(header + 8, 8);
+    sink->crc = get_be(header + 16, 4);
+    gettimeofday(&sink->start, NULL);
+
+    if (!file_path_allowed(sink->path)) {
+        // The transfer still runs to its end and fails its size check
+        sink->fd = -1;
+        fprintf(stderr, "<RECV_%d>: refusing %s from send_id=%d\n",
+                receiver->recv_id, sink->path, src_id);
+        return sink;
+    }
+    sink->fd = open(sink->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (sink->fd < 0) {
+        fprintf(stderr, "<RECV_%d>: cannot create %s for send_id=%d\n",
+                receiver->recv_id, sink->path, src_id);
+    } else if (ftruncate(sink->fd, sink->size) != 0) {
+        fprintf(stderr, "<RECV_%d>: cannot size %s\n", receiver->recv_id,
+                sink->path);
+    }
+    return sink;
+}
+
+// Frames arrive in order, so every chunk lands right after the previous one
+void file_sink_write(File_sink* sink, const char* data, size_t length) {
+    if (sink->fd >= 0 && sink->offset + length <= sink->size &&
+        pwrite(sink->fd, data, length, sink->offset) != (ssize_t) length) {
+        fprintf(stderr, "Write to %s failed\n", sink->path);
+    }
+    sink->offset += length;
+}
+
+// Check the size and crc of the whole file and report the transfer rate
+void file_sink_close(Receiver* receiver, File_sink* sink) {
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    double seconds = timeval_usecdiff(&sink->start, &end) / 1000000.0;
+
+    bool ok = sink->fd >= 0 && sink->offset == sink->size;
+    if (ok && sink->size > 0) {
+        char* data = mmap(NULL, sink->size, PROT_READ, MAP_SHARED, sink->fd, 0);
+        ok = data != MAP_FAILED && crc_buffer(data, sink->size) == sink->crc;
+        if (data != MAP_FAILED) {
+            munmap(data, sink->size);
+        }
+    }
+    if (sink->fd >= 0) {
+        close(sink->fd);
+    }
+
+    printf("<RECV_%d>:[file %s %llu bytes %s, %.2f MB/s]\n", receiver->recv_id,
+           sink->path, (unsigned long long) sink->offset,
+           ok ? "checksum ok" : "CHECKSUM MISMATCH",
+           seconds > 0 ? sink->offset / seconds / 1e6 : 0.0);
+    fflush(stdout);
+    free(sink->path);
+    free(sink);
+}
+
+// Drop a transfer cut off by shutdown, without checking or reporting it
+void file_sink_discard(File_sink* sink) {
+    if (sink->fd >= 0) {
+        close(sink->fd);
+    }
+    free(sink->path);
+    free(sink);
+}
@@ -0,0 +1,35 @@
+#ifndef __FILE_H__
+#define __FILE_H__
+
+#include "common.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A file travels as one message: a FILE_HEADER_SIZE byte header plus the
+// output path, followed by the file contents.
+//   magic "TTFILE1\0" | size (8, BE) | crc (4, BE) | path_len (2, BE) | path
+#define FILE_MAGIC "TTFILE1"
+#define FILE_MAGIC_SIZE 8
+#define FILE_HEADER_SIZE 22
+// Files get a stream of their own, so a loss in the middle of a transfer does
+// not hold back messages on the default stream
+#define FILE_STREAM (MAX_STREAMS - 1)
+
+// Sender side
+int sender_send_file(Sender* sender, uint16_t dst_id, const char* path,
+                     const char* out_path);
+
+// Receiver side, called from the receive callback for every chunk while
+// msg_buffer holds the start of a message
+bool file_header_started(const char* buf, size_t length);
+size_t file_header_length(const char* buf, size_t length);
+struct File_sink_t* file_sink_open(Receiver* receiver, uint8_t src_id,
+                                   const char* header);
+void file_sink_write(struct File_sink_t* sink, const char* data,
+                     size_t length);
+void file_sink_close(Receiver* receiver, struct File_sink_t* sink);
+void file_sink_discard(struct File_sink_t* sink);
+
+#endif
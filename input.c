@@ -1,12 +1,32 @@
 #include "input.h"
+#include "sender.h"
+#include "file.h"
+#include "trace.h"
 
 #include <assert.h>
+#include <ctype.h>
 
 //*********************************************************************
 // NOTE: We will overwrite this file, so whatever changes you put here
 //      WILL NOT persist
 //*********************************************************************
 
+// Queue occupancy of every sender against the -qlen/-qbytes budgets
+static void print_queue_stats() {
+    for (int i = 0; i < glb_senders_array_length; i++) {
+        Sender* sender = &glb_senders_array[i];
+        pthread_mutex_lock(&sender->buffer_mutex);
+        fprintf(stderr,
+                "send_id=%d: queued %u/%d cmds, %zu/%zu bytes (peak %u cmds, "
+                "%zu bytes), %u stalls, %d frames in flight\n",
+                i, sender->queued_cmds, glb_sysconfig.queue_cmds,
+                sender->queued_bytes, glb_sysconfig.queue_bytes,
+                sender->queued_cmds_peak, sender->queued_bytes_peak,
+                sender->queue_stalls, sender_in_flight(sender));
+        pthread_mutex_unlock(&sender->buffer_mutex);
+    }
+}
+
 /* getline implementation is copied from glibc. */
 
 #ifndef SIZE_MAX
@@ -79,10 +99,40 @@ end:
     return result;
 }
 
+// Turn the hex digits of text into bytes, in place. Returns the number of
+// bytes, or -1 if text is not an even number of hex digits.
+static int hex_decode(char* text) {
+    size_t digits = strlen(text);
+    if (digits == 0 || digits % 2 != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < digits; i += 2) {
+        unsigned int byte;
+        if (!isxdigit((unsigned char) text[i]) ||
+            !isxdigit((unsigned char) text[i + 1]) ||
+            sscanf(text + i, "%2x", &byte) != 1) {
+            return -1;
+        }
+        text[i / 2] = (char) byte;
+    }
+    return digits / 2;
+}
+
+// Check that the sender and receiver ids are in the right range
+static bool valid_ids(int sender_id, int receiver_id) {
+    bool valid = true;
+    if (sender_id >= glb_senders_array_length || sender_id < 0) {
+        fprintf(stderr, "Sender id is invalid\n");
+        valid = false;
+    }
+    if (receiver_id >= glb_receivers_array_length || receiver_id < 0) {
+        fprintf(stderr, "Receiver id is invalid\n");
+        valid = false;
+    }
+    return valid;
+}
+
 void* run_stdinthread(void* threadid) {
-    fd_set read_fds, master_fds;
-    int fd_max;
-    int select_res;
     int sender_id;
     int receiver_id;
     int sscanf_res;
@@ -95,115 +145,141 @@ void* run_stdinthread(void* threadid) {
 
     // Unused
     (void) threadid;
+    trace_thread_name("stdin");
 
-    // Zero out fd_sets
-    FD_ZERO(&read_fds);
-    FD_ZERO(&master_fds);
-
-    // Add standard input to the fd_set
-    FD_SET(STDIN_FILENO, &master_fds);
-    fd_max = STDIN_FILENO;
-
+    // Block in getline rather than select(): lines already pulled into
+    // stdin's buffer would never wake select() up again
     while (1) {
-        // Copy the master set to avoid permanently altering the master set
-        read_fds = master_fds;
-
-        if ((select_res = select(fd_max + 1, &read_fds, NULL, NULL, NULL)) ==
-            -1) {
-            perror("Select failed - exiting program");
+        input_buffer = malloc(input_buffer_size * sizeof(char));
+        assert(input_buffer);
+
+        // NULL set the entire input buffer
+        memset(input_buffer, 0, input_buffer_size * sizeof(char));
+
+        // Read in the command line into the input buffer
+        input_bytes_read =
+            getline(&input_buffer, &input_buffer_size, stdin);
+        
+        // If EOF is reached, getline returns -1
+        if (input_bytes_read == -1){
+            fprintf(stderr, "End Of File Reached\n");
+            free(input_buffer);
             pthread_exit(NULL);
         }
-
-        // User inputted a string, read in input and prepare to send
-        if (FD_ISSET(STDIN_FILENO, &read_fds)) {
-            input_buffer = malloc(input_buffer_size * sizeof(char));
-            assert(input_buffer);
-
-            // NULL set the entire input buffer
-            memset(input_buffer, 0, input_buffer_size * sizeof(char));
-
-            // Read in the command line into the input buffer
-            input_bytes_read =
-                getline(&input_buffer, &input_buffer_size, stdin);
-            
-            // If EOF is reached, getline returns -1
-            if (input_bytes_read == -1){
-                fprintf(stderr, "End Of File Reached\n");
-                pthread_exit(NULL);
+        
+        // Zero out the readin buffers for the command
+        memset(input_command, 0, MAX_COMMAND_LENGTH * sizeof(char));
+
+        // Zero out the memory for the message to communicate
+        input_message = malloc((input_bytes_read + 1) * sizeof(char));
+        assert(input_message);
+        memset(input_message, 0, (input_bytes_read + 1) * sizeof(char));
+
+        // Scan the input for the arguments
+        sscanf_res = sscanf(input_buffer, "%s %d %d %[^\n]", input_command,
+                            &sender_id, &receiver_id, input_message);
+
+        if (strcmp(input_command, "gmsg") == 0) {
+            // gmsg <src> <message>, to every receiver
+            sscanf_res = sscanf(input_buffer, "%s %d %[^\n]", input_command,
+                                &sender_id, input_message);
+            if (sscanf_res < 3) {
+                fprintf(stderr, "Command is ill-formatted\n");
+            } else if (valid_ids(sender_id, 0)) {
+                sender = &glb_senders_array[sender_id];
+                sender_send_group(sender, STREAM_DEFAULT, input_message,
+                                  strlen(input_message), PRIO_NORMAL);
             }
-            
-            // Zero out the readin buffers for the command
-            memset(input_command, 0, MAX_COMMAND_LENGTH * sizeof(char));
-
-            // Zero out the memory for the message to communicate
-            input_message = malloc((input_bytes_read + 1) * sizeof(char));
-            assert(input_message);
-            memset(input_message, 0, (input_bytes_read + 1) * sizeof(char));
-
-            // Scan the input for the arguments
-            sscanf_res = sscanf(input_buffer, "%s %d %d %[^\n]", input_command,
-                                &sender_id, &receiver_id, input_message);
-
+        } else if (sscanf_res < 4) {
             // Number of parsed objects is less than expected
-            if (sscanf_res < 4) {
-                if (strcmp(input_command, "exit") == 0) {
-                    free(input_message);
-                    free(input_buffer);
-                    return 0;
-                } else {
+            if (strcmp(input_command, "exit") == 0) {
+                free(input_message);
+                free(input_buffer);
+                return 0;
+            } else if (strcmp(input_command, "stats") == 0) {
+                print_queue_stats();
+            } else {
+                fprintf(stderr, "Command is ill-formatted\n");
+            }
+        } else {
+            if (strcmp(input_command, "msg") == 0) {
+                // Add the message to the input buffer of the
+                // appropriate thread
+                if (valid_ids(sender_id, receiver_id)) {
+                    sender = &glb_senders_array[sender_id];
+                    sender_send(sender, receiver_id, input_message,
+                                strlen(input_message));
+                }
+            } else if (strcmp(input_command, "xmsg") == 0) {
+                // xmsg <src> <dst> <hex bytes>, for payloads a line cannot
+                // hold, like NULs and newlines
+                int length = hex_decode(input_message);
+                if (length < 0) {
                     fprintf(stderr, "Command is ill-formatted\n");
+                } else if (valid_ids(sender_id, receiver_id)) {
+                    sender = &glb_senders_array[sender_id];
+                    sender_send(sender, receiver_id, input_message, length);
                 }
-            } else {
-                if (strcmp(input_command, "msg") == 0) {
-                    // Check to ensure that the sender and receiver ids are in
-                    // the right range
-                    if (sender_id >= glb_senders_array_length ||
-                        sender_id < 0) {
-                        fprintf(stderr, "Sender id is invalid\n");
-                    }
-                    if (receiver_id >= glb_receivers_array_length ||
-                        receiver_id < 0) {
-                        fprintf(stderr, "Receiver id is invalid\n");
-                    }
-
-                    // Only add if valid
-                    if (sender_id < glb_senders_array_length &&
-                        receiver_id < glb_receivers_array_length &&
-                        sender_id >= 0 && receiver_id >= 0) {
-                        // Add the message to the receive buffer for the
-                        // appropriate thread
-                        Cmd* outgoing_cmd = malloc(sizeof(Cmd));
-                        char* outgoing_msg =
-                            malloc(sizeof(char) * (strlen(input_message) + 1));
-
-                        // Copy out the input message into the outgoing command
-                        // object
-                        strcpy(outgoing_msg, input_message);
-
-                        outgoing_cmd->src_id = sender_id;
-                        outgoing_cmd->dst_id = receiver_id;
-                        outgoing_cmd->message = outgoing_msg;
-
-                        // Add it to the appropriate input buffer
-                        sender = &glb_senders_array[sender_id];
-
-                        // Lock the buffer, add to the input list, and signal
-                        // the thread
-                        pthread_mutex_lock(&sender->buffer_mutex);
-                        ll_append_node(&sender->input_cmdlist_head,
-                                       outgoing_cmd);
-                        pthread_cond_signal(&sender->buffer_cv);
-                        pthread_mutex_unlock(&sender->buffer_mutex);
+            } else if (strcmp(input_command, "file") == 0) {
+                // file <src> <dst> <path> [<output path>]. Neither path
+                // can be longer than the line they came from.
+                char* path = calloc(input_bytes_read + 1, sizeof(char));
+                char* out_path = calloc(input_bytes_read + 16, sizeof(char));
+                sscanf_res = sscanf(input_message, "%s %s", path, out_path);
+                if (sscanf_res < 1) {
+                    fprintf(stderr, "Command is ill-formatted\n");
+                } else if (valid_ids(sender_id, receiver_id)) {
+                    // Default output name keeps the source intact and lands
+                    // in the receiver's directory, which is all it accepts
+                    if (sscanf_res < 2) {
+                        char* name = strrchr(path, '/');
+                        snprintf(out_path, input_bytes_read + 16,
+                                 "%s.recv%d", name != NULL ? name + 1 : path,
+                                 receiver_id);
                     }
-                } else {
-                    fprintf(stderr, "Unknown command:%s\n", input_buffer);
+                    sender = &glb_senders_array[sender_id];
+                    sender_send_file(sender, receiver_id, path, out_path);
+                }
+                free(path);
+                free(out_path);
+            } else if (strcmp(input_command, "pmsg") == 0) {
+                // pmsg <src> <dst> <priority> <message>
+                int priority;
+                sscanf_res = sscanf(input_buffer, "%s %d %d %d %[^\n]",
+                                    input_command, &sender_id,
+                                    &receiver_id, &priority, input_message);
+                if (sscanf_res < 5 || priority < 0 ||
+                    priority >= NUM_PRIORITIES) {
+                    fprintf(stderr, "Command is ill-formatted\n");
+                } else if (valid_ids(sender_id, receiver_id)) {
+                    sender = &glb_senders_array[sender_id];
+                    sender_send_prio(sender, receiver_id, input_message,
+                                     strlen(input_message), priority);
+                }
+            } else if (strcmp(input_command, "smsg") == 0) {
+                // smsg <src> <dst> <stream> <message>
+                int stream_id;
+                sscanf_res = sscanf(input_buffer, "%s %d %d %d %[^\n]",
+                                    input_command, &sender_id,
+                                    &receiver_id, &stream_id, input_message);
+                // The last stream is reserved for file transfers
+                if (sscanf_res < 5 || stream_id < 0 ||
+                    stream_id >= FILE_STREAM) {
+                    fprintf(stderr, "Command is ill-formatted\n");
+                } else if (valid_ids(sender_id, receiver_id)) {
+                    sender = &glb_senders_array[sender_id];
+                    sender_send_stream(sender, receiver_id, stream_id,
+                                       input_message, strlen(input_message),
+                                       PRIO_NORMAL);
                 }
+            } else {
+                fprintf(stderr, "Unknown command:%s\n", input_buffer);
             }
-
-            // Lastly, free the input_buffer and the input_message
-            free(input_buffer);
-            free(input_message);
         }
+
+        // Lastly, free the input_buffer and the input_message
+        free(input_buffer);
+        free(input_message);
     }
     pthread_exit(NULL);
 }
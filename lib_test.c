@@ -0,0 +1,176 @@
+#include "tritontalk.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+// A host program of libtritontalk, built against tritontalk.h alone and
+// linked with both libtritontalk.a and libtritontalk.so. Every round sets up
+// the endpoints, sends over a lossy channel and tears everything down again,
+// so the second round checks that tt_destroy leaves nothing behind.
+
+#define SENDERS 2
+#define RECEIVERS 2
+#define MESSAGES 40
+#define ROUNDS 2
+
+static atomic_int delivered[RECEIVERS];
+static atomic_size_t delivered_bytes[RECEIVERS];
+static atomic_int acked[SENDERS];
+static atomic_int failed[SENDERS];
+static int failures;
+
+static void on_data(int recv_id, uint8_t src_id, uint8_t stream_id,
+                    const char* data, size_t length, bool is_last, void* ctx) {
+    (void) src_id;
+    (void) stream_id;
+    (void) ctx;
+    if (data != NULL) {
+        atomic_fetch_add(&delivered_bytes[recv_id], length);
+    }
+    if (is_last) {
+        atomic_fetch_add(&delivered[recv_id], 1);
+    }
+}
+
+static void on_sent(int send_id, uint16_t dst_id, void* user, bool ok,
+                    void* ctx) {
+    (void) dst_id;
+    (void) ctx;
+    // user is the message number, checked against the sender it came from
+    if (ok && (long) user / MESSAGES == send_id) {
+        atomic_fetch_add(&acked[send_id], 1);
+    } else {
+        atomic_fetch_add(&failed[send_id], 1);
+    }
+}
+
+static void run_round(int round) {
+    SysConfig config;
+    tt_default_config(&config);
+    config.drop_prob = 0.1;
+    config.corrupt_prob = 0.1;
+    config.drain_timeout = 30;
+    config.seed = round + 1;
+
+    size_t sent_bytes[RECEIVERS] = {0};
+    for (int i = 0; i < RECEIVERS; i++) {
+        atomic_store(&delivered[i], 0);
+        atomic_store(&delivered_bytes[i], 0);
+    }
+    for (int i = 0; i < SENDERS; i++) {
+        atomic_store(&acked[i], 0);
+        atomic_store(&failed[i], 0);
+    }
+
+    if (tt_init(&config, SENDERS, RECEIVERS) != 0) {
+        fprintf(stderr, "round %d: tt_init failed\n", round);
+        failures++;
+        return;
+    }
+    for (int i = 0; i < RECEIVERS; i++) {
+        if (tt_on_receive(i, on_data, NULL) != 0) {
+            fprintf(stderr, "round %d: tt_on_receive(%d) refused\n", round, i);
+            failures++;
+        }
+    }
+    for (int i = 0; i < SENDERS; i++) {
+        if (tt_on_sent(i, on_sent, NULL) != 0) {
+            fprintf(stderr, "round %d: tt_on_sent(%d) refused\n", round, i);
+            failures++;
+        }
+    }
+    if (tt_start() != 0) {
+        fprintf(stderr, "round %d: tt_start failed\n", round);
+        failures++;
+        tt_destroy();
+        return;
+    }
+
+    char buf[256];
+    for (int send_id = 0; send_id < SENDERS; send_id++) {
+        for (int i = 0; i < MESSAGES; i++) {
+            int dst_id = i % RECEIVERS;
+            // Some messages span several frames
+            int len = snprintf(buf, sizeof(buf),
+                               "round %d message %d from %d%*s", round, i,
+                               send_id, (i % 4) * 40, "");
+            if (tt_submit(send_id, dst_id, 0, buf, len,
+                          (void*) (long) (send_id * MESSAGES + i)) != 0) {
+                fprintf(stderr, "round %d: tt_submit refused\n", round);
+                failures++;
+                continue;
+            }
+            sent_bytes[dst_id] += len;
+        }
+    }
+    tt_shutdown();
+
+    for (int i = 0; i < SENDERS; i++) {
+        if (atomic_load(&acked[i]) != MESSAGES || atomic_load(&failed[i])) {
+            fprintf(stderr, "round %d: sender %d acked %d, failed %d of %d\n",
+                    round, i, atomic_load(&acked[i]),
+                    atomic_load(&failed[i]), MESSAGES);
+            failures++;
+        }
+    }
+    for (int i = 0; i < RECEIVERS; i++) {
+        int expected = SENDERS * MESSAGES / RECEIVERS;
+        if (atomic_load(&delivered[i]) != expected ||
+            atomic_load(&delivered_bytes[i]) != sent_bytes[i]) {
+            fprintf(stderr,
+                    "round %d: receiver %d got %d messages, %zu of %zu bytes\n",
+                    round, i, atomic_load(&delivered[i]),
+                    atomic_load(&delivered_bytes[i]), sent_bytes[i]);
+            failures++;
+        }
+    }
+    tt_destroy();
+}
+
+#define CHECK_REFUSED(call)                                                   \
+    do {                                                                      \
+        if ((call) != -1) {                                                   \
+            fprintf(stderr, "%s:%d: not refused: %s\n", __FILE__, __LINE__,  \
+                    #call);                                                   \
+            failures++;                                                       \
+        }                                                                     \
+    } while (0)
+
+// Ids outside the endpoints of the current tt_init, or with none at all, are
+// refused rather than written through
+static void check_bad_ids() {
+    CHECK_REFUSED(tt_on_receive(0, on_data, NULL));
+    CHECK_REFUSED(tt_on_sent(0, on_sent, NULL));
+    CHECK_REFUSED(tt_submit(0, 0, 0, "x", 1, NULL));
+
+    SysConfig config;
+    tt_default_config(&config);
+    if (tt_init(&config, SENDERS, RECEIVERS) != 0) {
+        fprintf(stderr, "bad ids: tt_init failed\n");
+        failures++;
+        return;
+    }
+    CHECK_REFUSED(tt_on_receive(-1, on_data, NULL));
+    CHECK_REFUSED(tt_on_receive(RECEIVERS, on_data, NULL));
+    CHECK_REFUSED(tt_on_receive(0, NULL, NULL));
+    CHECK_REFUSED(tt_on_sent(-1, on_sent, NULL));
+    CHECK_REFUSED(tt_on_sent(SENDERS, on_sent, NULL));
+    CHECK_REFUSED(tt_on_sent(0, NULL, NULL));
+    tt_destroy();
+}
+
+int main() {
+    check_bad_ids();
+    for (int round = 0; round < ROUNDS; round++) {
+        run_round(round);
+    }
+    // Nothing is left to hand callbacks to once everything is destroyed
+    check_bad_ids();
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("lib tests ok\n");
+    return 0;
+}
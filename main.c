@@ -1,8 +1,15 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "arq.h"
 #include "common.h"
 #include "communicate.h"
 #include "input.h"
+#include "perf.h"
 #include "receiver.h"
+#include "scenario.h"
 #include "sender.h"
+#include "trace.h"
+#include "tritontalk.h"
 #include "util.h"
 
 #include <assert.h>
@@ -18,51 +25,165 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+// Delivery completeness, once every thread has stopped
+static void drain_report(long drain_usec) {
+    uint32_t accepted = 0, delivered = 0;
+    int in_flight = 0;
+    int i, j;
+
+    for (i = 0; i < glb_senders_array_length; i++) {
+        Sender* sender = &glb_senders_array[i];
+        uint32_t sender_delivered = 0;
+        for (j = 0; j < glb_receivers_array_length; j++) {
+            sender_delivered += glb_receivers_array[j].msgs_delivered[i] +
+                glb_receivers_array[j].msgs_delivered[i + MAX_CLIENTS];
+        }
+        // A group message counts once per receiver
+        uint32_t sender_accepted =
+            sender->next_msg_id +
+            sender->group_msgs * (glb_receivers_array_length - 1);
+        accepted += sender_accepted;
+        delivered += sender_delivered;
+        in_flight += sender_in_flight(sender);
+        if (sender_delivered < sender_accepted) {
+            fprintf(stderr, "   send_id=%d: %u of %u messages delivered\n", i,
+                    sender_delivered, sender_accepted);
+        }
+    }
+    fprintf(stderr,
+            "Drained in %.3fs: %u of %u messages delivered, %d frame(s) "
+            "unacked\n",
+            drain_usec / 1000000.0, delivered, accepted, in_flight);
+
+    // How each sender ended up striping its frames
+    for (i = 0; glb_sysconfig.link_count > 1 && i < glb_senders_array_length;
+         i++) {
+        Sender* sender = &glb_senders_array[i];
+        fprintf(stderr, "   send_id=%d links:", i);
+        for (j = 0; j < glb_sysconfig.link_count; j++) {
+            fprintf(stderr, " [%d] %u frames, loss %.2f, rtt %.0fus", j,
+                    sender->link_frames[j], sender->link_loss[j],
+                    sender->link_rtt[j]);
+        }
+        fprintf(stderr, "\n");
+    }
+
+    // Whether busy polling caught the work it was meant to
+    if (glb_sysconfig.spin_usec > 0) {
+        unsigned long wakeups, blocks;
+        endpoint_spin_stats(&wakeups, &blocks);
+        fprintf(stderr, "Spin: %lu wakeup(s) while polling, %lu blocked\n",
+                wakeups, blocks);
+    }
+
+    // Reverse channel use, which -duplex cuts down
+    if (arq_policy()->acks) {
+        uint32_t acks_sent = 0, ack_units = 0, acks_piggybacked = 0;
+        for (j = 0; j < glb_receivers_array_length; j++) {
+            acks_sent += glb_receivers_array[j].acks_sent;
+            ack_units += glb_receivers_array[j].ack_units;
+            acks_piggybacked += glb_receivers_array[j].acks_piggybacked;
+        }
+        fprintf(stderr,
+                "Acks: %u sent in %u channel unit(s), %u piggybacked\n",
+                acks_sent, ack_units, acks_piggybacked);
+    }
+}
+
 int main(int argc, char* argv[]) {
     pthread_t stdin_thread;
-    pthread_t* sender_threads;
-    pthread_t* receiver_threads;
+    SysConfig config;
+    int senders = -1, receivers = -1;
     int i;
     unsigned char print_usage = 0;
+    const char* trace_path = NULL;
+    unsigned char profile = 0;
 
-    // DO NOT CHANGE THIS
-    // Set the number of bits to corrupt
-    CORRUPTION_BITS = (int) MAX_FRAME_SIZE / 2;
-
-    // DO NOT CHANGE THIS
-    // Prepare the glb_sysconfig object
-    glb_sysconfig.drop_prob = 0;
-    glb_sysconfig.corrupt_prob = 0;
-    glb_sysconfig.automated = 0;
-    memset(glb_sysconfig.automated_file, 0, AUTOMATED_FILENAME);
-
-    // DO NOT CHANGE THIS
-    // Prepare other variables and seed the psuedo random number generator
-    glb_receivers_array_length = -1;
-    glb_senders_array_length = -1;
-    srand(time(NULL));
+    tt_default_config(&config);
 
     // Parse out the command line arguments
     for (i = 1; i < argc;) {
         if (strcmp(argv[i], "-s") == 0) {
-            sscanf(argv[i + 1], "%d", &glb_senders_array_length);
+            sscanf(argv[i + 1], "%d", &senders);
             i += 2;
         }
 
         else if (strcmp(argv[i], "-r") == 0) {
-            sscanf(argv[i + 1], "%d", &glb_receivers_array_length);
+            sscanf(argv[i + 1], "%d", &receivers);
             i += 2;
         } else if (strcmp(argv[i], "-d") == 0) {
-            sscanf(argv[i + 1], "%f", &glb_sysconfig.drop_prob);
+            sscanf(argv[i + 1], "%f", &config.drop_prob);
             i += 2;
         } else if (strcmp(argv[i], "-c") == 0) {
-            sscanf(argv[i + 1], "%f", &glb_sysconfig.corrupt_prob);
+            sscanf(argv[i + 1], "%f", &config.corrupt_prob);
+            i += 2;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            sscanf(argv[i + 1], "%d", &config.fec_group_size);
+            i += 2;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            sscanf(argv[i + 1], "%d", &config.fec_parity_count);
+            i += 2;
+        } else if (strcmp(argv[i], "-pipeline") == 0) {
+            sscanf(argv[i + 1], "%d", &config.pipelined);
+            i += 2;
+        } else if (strcmp(argv[i], "-drain") == 0) {
+            sscanf(argv[i + 1], "%f", &config.drain_timeout);
+            i += 2;
+        } else if (strcmp(argv[i], "-mode") == 0) {
+            config.arq_mode = arq_parse_mode(argv[i + 1]);
+            i += 2;
+        } else if (strcmp(argv[i], "-qlen") == 0) {
+            sscanf(argv[i + 1], "%d", &config.queue_cmds);
+            i += 2;
+        } else if (strcmp(argv[i], "-qbytes") == 0) {
+            sscanf(argv[i + 1], "%zu", &config.queue_bytes);
+            i += 2;
+        } else if (strcmp(argv[i], "-spin") == 0) {
+            sscanf(argv[i + 1], "%d", &config.spin_usec);
+            i += 2;
+        } else if (strcmp(argv[i], "-pin") == 0) {
+            sscanf(argv[i + 1], "%d", &config.pin_cpu);
+            i += 2;
+        } else if (strcmp(argv[i], "-links") == 0) {
+            sscanf(argv[i + 1], "%d", &config.link_count);
+            i += 2;
+        } else if (strcmp(argv[i], "-link") == 0 && i + 3 < argc) {
+            // -link <index> <drop prob> <corrupt prob>
+            int link = -1;
+            sscanf(argv[i + 1], "%d", &link);
+            if (link < 0 || link >= MAX_LINKS) {
+                print_usage = 1;
+            } else {
+                sscanf(argv[i + 2], "%f", &config.link_drop[link]);
+                sscanf(argv[i + 3], "%f", &config.link_corrupt[link]);
+            }
+            i += 4;
+        } else if (strcmp(argv[i], "-pace") == 0) {
+            // A rate in frames/s, or auto to follow cwnd and RTT
+            if (strcmp(argv[i + 1], "auto") == 0) {
+                config.pace_rate = -1;
+            } else {
+                sscanf(argv[i + 1], "%f", &config.pace_rate);
+                print_usage |= config.pace_rate <= 0;
+            }
+            i += 2;
+        } else if (strcmp(argv[i], "-perf") == 0) {
+            profile = 1;
+            i++;
+        } else if (strcmp(argv[i], "-duplex") == 0) {
+            config.duplex = true;
+            i++;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            trace_path = argv[i + 1];
+            i += 2;
+        } else if (strcmp(argv[i], "-seed") == 0) {
+            sscanf(argv[i + 1], "%llu", &config.seed);
             i += 2;
         } else if (strcmp(argv[i], "-a") == 0) {
             int filename_len = strlen(argv[i + 1]);
             if (filename_len < AUTOMATED_FILENAME) {
-                glb_sysconfig.automated = 1;
-                strcpy(glb_sysconfig.automated_file, argv[i + 1]);
+                config.automated = 1;
+                strcpy(config.automated_file, argv[i + 1]);
             }
             i += 2;
         } else if (strcmp(argv[i], "-h") == 0) {
@@ -73,101 +194,107 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    // Spot check the input variables
-    if (glb_senders_array_length <= 0 || glb_receivers_array_length <= 0 ||
-        (glb_sysconfig.drop_prob < 0 || glb_sysconfig.drop_prob > 1) ||
-        (glb_sysconfig.corrupt_prob < 0 || glb_sysconfig.corrupt_prob > 1) ||
-        print_usage) {
+    // Spot check the input variables, creating the endpoints if they pass
+    if (print_usage || tt_init(&config, senders, receivers) != 0) {
         fprintf(
             stderr,
             "USAGE: %s \n   -r int [# of receivers] \n   -s int [# of senders] "
             "\n   -c float [0 <= corruption prob <= 1] \n   -d float [0 <= "
-            "drop prob <= 1]\n",
-            argv[0]);
+            "drop prob <= 1]\n   -k int [0 <= FEC group size <= %d, 0 "
+            "disables FEC] \n   -m int [1 <= FEC parity frames per group <= "
+            "%d]\n   -pipeline 0|1 [frame on a helper thread per sender, "
+            "default 1]\n   -seed int [channel impairment seed, default "
+            "time]\n   -mode sr|gbn|dgram [Selective Repeat, Go-Back-N or "
+            "unacked datagrams, default sr; no FEC with dgram]\n   -drain "
+            "float [seconds to wait for unacked data at exit, default 5]\n   "
+            "-qlen int [unframed commands per sender before "
+            "input blocks, default 256]\n   -qbytes int [unframed bytes per "
+            "sender before input blocks, default 1048576]\n   -spin int [0 <= "
+            "microseconds endpoint threads busy-poll before blocking <= "
+            "1000000, default 0]\n   -pin int [pin endpoint threads to CPUs "
+            "from this one on]\n   -duplex [sender i and receiver i form host "
+            "i and piggyback acks; needs -s == -r, not with dgram]\n   -links "
+            "int [1 <= data links per sender <= %d, default 1]\n   -link int "
+            "float float [drop and corrupt prob of one link, default -d and "
+            "-c]\n   -pace float|auto [frames/s per destination, or estimated "
+            "from cwnd and RTT; default unpaced]\n   -a file [run the timed "
+            "phases in file instead of reading stdin]\n   -perf [count "
+            "cycles, instructions and misses per stage, reported at exit]\n"
+            "   -t file [write a binary frame trace, see "
+            "trace_tool.py]\n",
+            argv[0], FEC_MAX_GROUP_SIZE, FEC_MAX_PARITY, MAX_LINKS);
         exit(1);
     }
 
-    // DO NOT CHANGE THIS
-    // Init the pthreads data structure
-    sender_threads = malloc(sizeof(pthread_t) * glb_senders_array_length);
-    assert(sender_threads);
-    receiver_threads = malloc(sizeof(pthread_t) * glb_receivers_array_length);
-    assert(receiver_threads);
-
-    // Init the global senders array
-    glb_senders_array = malloc(glb_senders_array_length * sizeof(Sender));
-    assert(glb_senders_array);
-    glb_receivers_array = malloc(glb_receivers_array_length * sizeof(Receiver));
-    assert(glb_receivers_array);
+    if (glb_sysconfig.automated &&
+        scenario_load(glb_sysconfig.automated_file) != 0) {
+        exit(1);
+    }
 
     fprintf(stderr, "Messages will be dropped with probability=%f\n",
             glb_sysconfig.drop_prob);
     fprintf(stderr, "Messages will be corrupted with probability=%f\n",
             glb_sysconfig.corrupt_prob);
+    fprintf(stderr, "Channel seed=%llu\n", glb_sysconfig.seed);
+    if (trace_path != NULL && trace_open(trace_path) != 0) {
+        exit(1);
+    }
+    if (profile && perf_open() != 0) {
+        exit(1);
+    }
+    fprintf(stderr, "Reliability mode=%s\n", arq_policy()->name);
+    if (glb_sysconfig.fec_group_size > 0) {
+        fprintf(stderr, "FEC: %d parity frame(s) per %d data frames\n",
+                glb_sysconfig.fec_parity_count, glb_sysconfig.fec_group_size);
+    }
+    for (i = 0; glb_sysconfig.link_count > 1 && i < glb_sysconfig.link_count;
+         i++) {
+        fprintf(stderr, "Link %d: drop=%f corrupt=%f\n", i,
+                glb_sysconfig.link_drop[i], glb_sysconfig.link_corrupt[i]);
+    }
+    if (glb_sysconfig.pace_rate > 0) {
+        fprintf(stderr, "Pacing at %.1f frames/s per destination\n",
+                glb_sysconfig.pace_rate);
+    } else if (glb_sysconfig.pace_rate < 0) {
+        fprintf(stderr, "Pacing at 1.25 x cwnd per RTT\n");
+    }
+    if (glb_sysconfig.spin_usec > 0) {
+        fprintf(stderr, "Busy-polling %d us before blocking\n",
+                glb_sysconfig.spin_usec);
+    }
     fprintf(stderr, "Available sender id(s):\n");
-
-    // Init sender objects, assign ids
-    // NOTE: Do whatever initialization you want here or inside the init_sender
-    // function
     for (i = 0; i < glb_senders_array_length; i++) {
-        init_sender(&glb_senders_array[i], i);
         fprintf(stderr, "   send_id=%d\n", i);
     }
-
-    // Init receiver objects, assign ids
-    // NOTE: Do whatever initialization you want here or inside the
-    // init_receiver function
     fprintf(stderr, "Available receiver id(s):\n");
     for (i = 0; i < glb_receivers_array_length; i++) {
-        init_receiver(&glb_receivers_array[i], i);
         fprintf(stderr, "   recv_id=%d\n", i);
     }
 
+    if (tt_start() != 0) {
+        exit(-1);
+    }
+
     // DO NOT CHANGE THIS
     // Create the standard input thread
-    int rc = pthread_create(&stdin_thread, NULL, run_stdinthread, (void*) 0);
+    int rc = pthread_create(&stdin_thread, NULL,
+                            glb_sysconfig.automated ? run_scenario
+                                                    : run_stdinthread,
+                            (void*) 0);
     if (rc) {
         fprintf(stderr, "ERROR; return code from pthread_create() is %d\n", rc);
         exit(-1);
     }
-
-    // Spawn sender threads
-    for (i = 0; i < glb_senders_array_length; i++) {
-        rc = pthread_create(sender_threads + i, NULL, run_sender,
-                            (void*) &glb_senders_array[i]);
-        if (rc) {
-            fprintf(stderr, "ERROR; return code from pthread_create() is %d\n",
-                    rc);
-            exit(-1);
-        }
-    }
-
-    // Spawn receiver threads
-    for (i = 0; i < glb_receivers_array_length; i++) {
-        rc = pthread_create(receiver_threads + i, NULL, run_receiver,
-                            (void*) &glb_receivers_array[i]);
-        if (rc) {
-            fprintf(stderr, "ERROR; return code from pthread_create() is %d\n",
-                    rc);
-            exit(-1);
-        }
-    }
     pthread_join(stdin_thread, NULL);
 
-    for (i = 0; i < glb_senders_array_length; i++) {
-        pthread_cancel(sender_threads[i]);
-        pthread_join(sender_threads[i], NULL);
-    }
+    long drain_usec = tt_shutdown();
 
-    for (i = 0; i < glb_receivers_array_length; i++) {
-        pthread_cancel(receiver_threads[i]);
-        pthread_join(receiver_threads[i], NULL);
-    }
+    drain_report(drain_usec);
+    scenario_report();
+    perf_report();
 
-    free(sender_threads);
-    free(receiver_threads);
-    free(glb_senders_array);
-    free(glb_receivers_array);
+    trace_close();
+    tt_destroy();
 
     return 0;
 }
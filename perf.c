@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+
+#include "perf.h"
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct Perf_event_t {
+    uint32_t type;
+    uint64_t config;
+    const char* name;
+};
+
+// The task clock leads the group since it exists everywhere; hardware events
+// join it when the CPU (or hypervisor) exposes them
+static const struct Perf_event_t perf_events[PERF_COUNTERS] = {
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "ns"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instr"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-miss"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-miss"},
+};
+
+static const char* perf_stage_names[PERF_STAGES] = {
+    "input_cmds", "framing", "compute_crc",
+    "send_frame", "incoming_acks", "incoming_msgs",
+};
+
+bool perf_on = false;
+
+// Counters the main thread could open; other threads open the same set
+static bool perf_available[PERF_COUNTERS];
+static int perf_open_count;
+
+static atomic_ullong perf_totals[PERF_STAGES][PERF_COUNTERS];
+static atomic_ullong perf_units[PERF_STAGES];
+static atomic_ullong perf_calls[PERF_STAGES];
+static atomic_ullong perf_failed_threads;
+
+// Group leader of this thread, -2 before the first stage, -1 if it failed
+static _Thread_local int perf_fd = -2;
+
+// Counts of every stage this thread has finished, each one's whole delta
+// once. A stage subtracts what grew here while it ran.
+static _Thread_local uint64_t perf_nested[PERF_COUNTERS];
+
+static int perf_event_open(const struct Perf_event_t* event, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = event->type;
+    attr.config = event->config;
+    attr.disabled = group == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+// Open this thread's group. probe records which counters exist instead of
+// requiring the ones perf_open found.
+static int perf_open_group(bool probe) {
+    int fds[PERF_COUNTERS];
+    int leader = -1;
+    int opened = 0;
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (!probe && !perf_available[i]) {
+            continue;
+        }
+        int fd = perf_event_open(&perf_events[i], leader);
+        if (fd < 0 && (i == 0 || !probe)) {
+            while (opened > 0) {
+                close(fds[--opened]);
+            }
+            return -1;
+        }
+        if (probe) {
+            perf_available[i] = fd >= 0;
+        }
+        if (fd >= 0) {
+            fds[opened++] = fd;
+            if (leader == -1) {
+                leader = fd;
+            }
+        }
+    }
+    perf_open_count = opened;
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return leader;
+}
+
+// Turn profiling on if at least the task clock can be counted
+int perf_open() {
+    perf_fd = perf_open_group(true);
+    if (perf_fd < 0) {
+        fprintf(stderr, "Cannot profile, perf_event_open: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    perf_on = true;
+    fprintf(stderr, "Profiling stages with:");
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (perf_available[i]) {
+            fprintf(stderr, " %s", perf_events[i].name);
+        }
+    }
+    fprintf(stderr, "\n");
+    return 0;
+}
+
+static void perf_read(Perf_sample* sample) {
+    if (perf_fd == -2) {
+        perf_fd = perf_open_group(false);
+        if (perf_fd < 0) {
+            atomic_fetch_add(&perf_failed_threads, 1);
+        }
+    }
+    sample->valid = false;
+    if (perf_fd < 0) {
+        return;
+    }
+
+    // PERF_FORMAT_GROUP: the number of counters, then their values in the
+    // order they were opened
+    uint64_t buf[1 + PERF_COUNTERS];
+    ssize_t len = read(perf_fd, buf, sizeof(buf));
+    if (len < (ssize_t) sizeof(uint64_t) * (1 + perf_open_count)) {
+        return;
+    }
+    for (int i = 0, j = 1; i < PERF_COUNTERS; i++) {
+        sample->values[i] = perf_available[i] ? buf[j++] : 0;
+    }
+    sample->valid = true;
+}
+
+void perf_start(Perf_sample* sample) {
+    perf_read(sample);
+    memcpy(sample->nested, perf_nested, sizeof(perf_nested));
+}
+
+// Count the stage without the stages nested in it. The stage then stands in
+// for its nested ones, so the stage around it subtracts it only once.
+void perf_add(enum Perf_stage stage, Perf_sample* start, uint32_t units) {
+    Perf_sample end;
+    if (!start->valid) {
+        return;
+    }
+    perf_read(&end);
+    if (!end.valid) {
+        return;
+    }
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        uint64_t total = end.values[i] - start->values[i];
+        uint64_t nested = perf_nested[i] - start->nested[i];
+        atomic_fetch_add_explicit(&perf_totals[stage][i],
+                                  total > nested ? total - nested : 0,
+                                  memory_order_relaxed);
+        perf_nested[i] = start->nested[i] + total;
+    }
+    atomic_fetch_add_explicit(&perf_units[stage], units,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&perf_calls[stage], 1, memory_order_relaxed);
+}
+
+// Per-unit averages of every stage that ran
+void perf_report() {
+    if (!perf_on) {
+        return;
+    }
+    fprintf(stderr, "%-14s %9s %9s", "stage", "calls", "units");
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (perf_available[i]) {
+            fprintf(stderr, " %11s", perf_events[i].name);
+        }
+    }
+    fprintf(stderr, "   (per unit)\n");
+    for (int s = 0; s < PERF_STAGES; s++) {
+        unsigned long long units = atomic_load(&perf_units[s]);
+        if (units == 0) {
+            continue;
+        }
+        fprintf(stderr, "%-14s %9llu %9llu", perf_stage_names[s],
+                (unsigned long long) atomic_load(&perf_calls[s]), units);
+        for (int i = 0; i < PERF_COUNTERS; i++) {
+            if (perf_available[i]) {
+                fprintf(stderr, " %11.1f",
+                        (double) atomic_load(&perf_totals[s][i]) / units);
+            }
+        }
+        fprintf(stderr, "\n");
+    }
+    if (atomic_load(&perf_failed_threads) > 0) {
+        fprintf(stderr, "%llu thread(s) could not open their counters\n",
+                (unsigned long long) atomic_load(&perf_failed_threads));
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Per-stage counter profiling, enabled with -perf. Every thread opens one
+// perf_event_open group the first time it enters a stage: task clock, plus
+// cycles, instructions, cache misses and branch misses where the hardware
+// exposes them, all user space only. The counter deltas around each stage are
+// summed per stage and perf_report prints per-unit averages at shutdown.
+// Stages only count their own work: a stage running inside another, like
+// compute_crc inside framing, is taken out of the enclosing stage's counts.
+enum Perf_stage {
+    PERF_INPUT_CMDS,     // handle_input_cmds, per command
+    PERF_FRAMING,        // frame_ahead, per frame cut
+    PERF_CRC,            // compute_crc, per frame or ack record
+    PERF_SEND_FRAME,     // send_frame, per frame handed to the channel
+    PERF_INCOMING_ACKS,  // handle_incoming_acks, per ack
+    PERF_INCOMING_MSGS,  // handle_incoming_msgs, per frame
+    PERF_STAGES
+};
+
+#define PERF_COUNTERS 5
+
+struct Perf_sample_t {
+    uint64_t values[PERF_COUNTERS];
+    uint64_t nested[PERF_COUNTERS]; // nested stage counts so far, see perf_add
+    bool valid;
+};
+typedef struct Perf_sample_t Perf_sample;
+
+extern bool perf_on;
+
+int perf_open();
+void perf_report();
+void perf_start(Perf_sample* sample);
+void perf_add(enum Perf_stage stage, Perf_sample* start, uint32_t units);
+
+// Cost one predictable branch when profiling is off
+static inline void perf_begin(Perf_sample* sample) {
+    if (perf_on) {
+        perf_start(sample);
+    }
+}
+
+static inline void perf_end(enum Perf_stage stage, Perf_sample* start,
+                            uint32_t units) {
+    if (perf_on) {
+        perf_add(stage, start, units);
+    }
+}
+
+#endif
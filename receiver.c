@@ -1,6 +1,23 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "receiver.h"
+#include "arq.h"
+#include "fec.h"
+#include "file.h"
+#include "perf.h"
+#include "simd.h"
+#include "trace.h"
 #include <math.h>
 
+// Duplex: how long an ack waits for a data frame to ride on, and how many
+// frames it may cover before it goes out on its own
+#define ACK_DELAY_USEC 5000
+#define ACK_MAX_FRAMES (WINDOW_SIZE / 2)
+
+// Acks sent per sender in one pass, see pack_acks
+#define ACK_STRIDE 2
+#define ACK_KEYS (MAX_CLIENTS * MAX_CLIENTS * 2)
+
 void init_receiver(Receiver* receiver, int id) {
     pthread_cond_init(&receiver->buffer_cv, NULL);
     pthread_mutex_init(&receiver->buffer_mutex, NULL);
@@ -10,121 +27,539 @@ void init_receiver(Receiver* receiver, int id) {
 
     for (int i = 0; i < MAX_CLIENTS; i++) {
         receiver->ingoing_frames_head_ptr_map[i] = NULL;
+    }
+    for (int i = 0; i < MAX_PEERS; i++) {
         receiver->LCA[i] = 0;
-        for (int j = 0; j < UINT8_MAX; j++) {
+        for (int j = 0; j <= UINT8_MAX; j++) {
             receiver->frame_buffer[i][j] = NULL;
         }
+        seq_bitmap_init(&receiver->recv_map[i]);
+        seq_bitmap_init(&receiver->undelivered[i]);
+        for (int j = 0; j < MAX_STREAMS; j++) {
+            receiver->msg_buffer[i][j] = NULL;
+            receiver->msg_length[i][j] = 0;
+            receiver->msg_capacity[i][j] = 0;
+            receiver->file_sink[i][j] = NULL;
+        }
+        receiver->msgs_delivered[i] = 0;
+        receiver->open_streams[i] = 0;
     }
+    receiver->acks_owed = 0;
+    receiver->host_acks = NULL;
+    receiver->acks_sent = 0;
+    receiver->ack_units = 0;
+    receiver->acks_piggybacked = 0;
+    receiver->stop = false;
+    receiver->on_data = print_message;
+    receiver->on_data_ctx = NULL;
+    fec_init_receiver(receiver);
 }
 
-char* print_buffer(Receiver* receiver, int src_id, uint8_t last_seq_num) {
-    int length = 0;
-    int idx = last_seq_num;
+// Free everything the receiver still holds. Its thread must have been joined.
+void destroy_receiver(Receiver* receiver) {
+    ll_free_list(&receiver->input_framelist_head);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        ll_free_list(&receiver->ingoing_frames_head_ptr_map[i]);
+    }
+    free(receiver->ingoing_frames_head_ptr_map);
+    receiver->ingoing_frames_head_ptr_map = NULL;
+    ll_free_list(&receiver->host_acks);
+    for (int i = 0; i < MAX_PEERS; i++) {
+        for (int j = 0; j <= UINT8_MAX; j++) {
+            free(receiver->frame_buffer[i][j]);
+            receiver->frame_buffer[i][j] = NULL;
+        }
+        for (int j = 0; j < MAX_STREAMS; j++) {
+            free(receiver->msg_buffer[i][j]);
+            receiver->msg_buffer[i][j] = NULL;
+            if (receiver->file_sink[i][j] != NULL) {
+                file_sink_discard(receiver->file_sink[i][j]);
+                receiver->file_sink[i][j] = NULL;
+            }
+        }
+    }
+    fec_destroy_receiver(receiver);
+    pthread_cond_destroy(&receiver->buffer_cv);
+    pthread_mutex_destroy(&receiver->buffer_mutex);
+}
 
-    while (true) {
-        length += receiver->frame_buffer[src_id][idx]->length;
-        if (receiver->frame_buffer[src_id][idx]->is_first == 1) {
-            break;
+// Make run_receiver return at its next wakeup
+void receiver_stop(Receiver* receiver) {
+    pthread_mutex_lock(&receiver->buffer_mutex);
+    receiver->stop = true;
+    pthread_cond_signal(&receiver->buffer_cv);
+    pthread_mutex_unlock(&receiver->buffer_mutex);
+}
+
+void receiver_set_callback(Receiver* receiver, Recv_callback on_data,
+                           void* ctx) {
+    pthread_mutex_lock(&receiver->buffer_mutex);
+    receiver->on_data = on_data;
+    receiver->on_data_ctx = ctx;
+    pthread_mutex_unlock(&receiver->buffer_mutex);
+}
+
+// Default callback: collect the chunks of a message and print it once the
+// last one arrives. A message on FILE_STREAM that starts with a file header is
+// written to the file it names instead (see file.c). Each stream reassembles
+// on its own.
+void print_message(Receiver* receiver, uint8_t src_id, uint8_t stream_id,
+                   const char* data, size_t length, bool is_last, void* ctx) {
+    (void) ctx;
+    struct File_sink_t** sink = &receiver->file_sink[src_id][stream_id];
+    if (data == NULL) {
+        // A truncated file fails its size check and is reported as such
+        if (*sink != NULL) {
+            file_sink_close(receiver, *sink);
+            *sink = NULL;
         }
-        idx = prev_seq(idx);
+        receiver->msg_length[src_id][stream_id] = 0;
+        return;
     }
+    if (*sink != NULL) {
+        file_sink_write(*sink, data, length);
+        if (is_last) {
+            file_sink_close(receiver, *sink);
+            *sink = NULL;
+        }
+        return;
+    }
+
+    char** buffer = &receiver->msg_buffer[src_id][stream_id];
+    size_t* buffer_length = &receiver->msg_length[src_id][stream_id];
+    size_t* capacity = &receiver->msg_capacity[src_id][stream_id];
+    size_t needed = *buffer_length + length;
 
-    char* msg = calloc(length, sizeof(char));
-    int count = 0;
-    while (true) {
-        for (int i = 0; i < receiver->frame_buffer[src_id][idx]->length; i = next_seq(i)) {
-            msg[count + i] = receiver->frame_buffer[src_id][idx]->data[i];
+    if (needed > *capacity) {
+        size_t new_capacity = *capacity * 2;
+        if (new_capacity < needed) {
+            new_capacity = needed;
         }
-        if (receiver->frame_buffer[src_id][idx]->is_last == 1) {
-            break;
+        *buffer = realloc(*buffer, new_capacity);
+        *capacity = new_capacity;
+    }
+    memcpy(*buffer + *buffer_length, data, length);
+    *buffer_length = needed;
+
+    if (stream_id == FILE_STREAM && file_header_started(*buffer, needed)) {
+        size_t header_length = file_header_length(*buffer, needed);
+        if (header_length > 0) {
+            *sink = file_sink_open(receiver, src_id, *buffer);
+            file_sink_write(*sink, *buffer + header_length,
+                            needed - header_length);
+            *buffer_length = 0;
+            if (is_last) {
+                file_sink_close(receiver, *sink);
+                *sink = NULL;
+            }
+            return;
         }
-        count += receiver->frame_buffer[src_id][idx]->length;
-        idx = next_seq(idx);
     }
-    return msg;
+
+    // Byte for byte: payloads may hold NULs. Hold stdout for the whole line so
+    // other receiver threads cannot print into the middle of it.
+    if (is_last) {
+        flockfile(stdout);
+        printf("<RECV_%d>:[", receiver->recv_id);
+        fwrite(*buffer, 1, *buffer_length, stdout);
+        printf("]\n");
+        fflush(stdout);
+        funlockfile(stdout);
+        *buffer_length = 0;
+    }
 }
 
-void clean_buffer(Receiver* receiver, int src_id, uint8_t last_seq_num) {
-    while (true) {
-        bool stop = receiver->frame_buffer[src_id][last_seq_num]->is_first == 1;
-        free(receiver->frame_buffer[src_id][last_seq_num]);
-        receiver->frame_buffer[src_id][last_seq_num] = NULL;
-        if (stop) {
-            return;
+// Hand one frame of payload to the callback
+void receiver_deliver(Receiver* receiver, Frame* frame) {
+    bool is_last = (frame->flags & FRAME_LAST) != 0;
+    receiver->on_data(receiver, frame->src_id, frame->stream_id, frame->data,
+                      frame->length, is_last, receiver->on_data_ctx);
+    if (is_last) {
+        receiver->msgs_delivered[frame->src_id]++;
+        trace_event(TRACE_MSG_DELIVERED, frame->src_id, receiver->recv_id,
+                    frame->seq_num, 0);
+    }
+}
+
+// Tell the callback the rest of the current message on a stream is lost
+void receiver_abort_message(Receiver* receiver, uint8_t src_id,
+                            uint8_t stream_id) {
+    receiver->on_data(receiver, src_id, stream_id, NULL, 0, true,
+                      receiver->on_data_ctx);
+}
+
+// Whether every earlier frame of the frame's stream has been delivered. The
+// previous frame is either at or behind the LCA, or received past it and no
+// longer waiting in frame_buffer.
+static bool stream_ready(Receiver* receiver, Frame* frame) {
+    int back = (frame->flags & FRAME_PREV_MASK) >> FRAME_PREV_SHIFT;
+    if (back == 0) {
+        return true;
+    }
+    uint8_t prev = frame->seq_num;
+    for (int i = 0; i < back; i++) {
+        prev = prev_seq(prev);
+    }
+    if (!within_window(prev, receiver->LCA[frame->src_id])) {
+        return true;
+    }
+    return !seq_bitmap_test(&receiver->undelivered[frame->src_id], prev) &&
+           seq_bitmap_test(&receiver->recv_map[frame->src_id], prev);
+}
+
+// Hand every buffered frame after first_seq_num whose stream is in order to
+// the callback and release it. Frames point back at earlier seq_nums only, so
+// one pass in sequence order also releases chains.
+void deliver_frames(Receiver* receiver, int src_id, uint8_t first_seq_num) {
+    uint8_t idx = first_seq_num;
+    for (int i = 1; i < WINDOW_SIZE; i++) {
+        idx = next_seq(idx);
+        Frame* frame = receiver->frame_buffer[src_id][idx];
+        if (frame == NULL || !stream_ready(receiver, frame)) {
+            continue;
         }
-        last_seq_num = prev_seq(last_seq_num);
+
+        receiver_deliver(receiver, frame);
+        free(frame);
+        receiver->frame_buffer[src_id][idx] = NULL;
+        seq_bitmap_clear(&receiver->undelivered[src_id], idx);
     }
 }
 
+// Last seq_num before the first frame missing after last_seq_num. The LCA
+// starts out as 0, which prev_seq never returns, hence the explicit check.
 int calc_LCA(Receiver* receiver, int src_id, uint8_t last_seq_num) {
-    uint8_t idx = next_seq(last_seq_num);
+    uint8_t gap =
+        seq_bitmap_next_gap(&receiver->recv_map[src_id], last_seq_num);
+    if (gap == next_seq(last_seq_num)) {
+        return last_seq_num;
+    }
+    return prev_seq(gap);
+}
 
-    while (true) {
-        if (idx == 0) {
-            idx++;
-            continue;
+// Buffer a valid in-window data frame, deliver every frame that is now in
+// order within its stream and advance the LCA over everything received
+void accept_frame(Receiver* receiver, Frame* frame) {
+    uint8_t src_id = frame->src_id;
+    uint8_t old_LCA = receiver->LCA[src_id];
+    if (frame->stream_id >= MAX_STREAMS) {
+        return;
+    }
+
+    // Insert to buffer
+    if (!seq_bitmap_test(&receiver->recv_map[src_id], frame->seq_num)) {
+        receiver->frame_buffer[src_id][frame->seq_num] = copy_frame(frame);
+        seq_bitmap_set(&receiver->recv_map[src_id], frame->seq_num);
+        seq_bitmap_set(&receiver->undelivered[src_id], frame->seq_num);
+        deliver_frames(receiver, src_id, old_LCA);
+    }
+    if (fec_enabled()) {
+        fec_store_frame(receiver, frame);
+    }
+
+    // Everything up to the new LCA has been received, and so delivered
+    uint8_t new_LCA = calc_LCA(receiver, src_id, old_LCA);
+    if (new_LCA != old_LCA) {
+        receiver->LCA[src_id] = new_LCA;
+        seq_bitmap_clear_range(&receiver->recv_map[src_id], old_LCA, new_LCA);
+    }
+
+    if (fec_enabled()) {
+        fec_retire(receiver, src_id, old_LCA, receiver->LCA[src_id]);
+    }
+}
+
+// Frames src_id may still send: what is left of RECV_QUEUE_LIMIT once the
+// frames waiting in the input list and those buffered out of order are counted
+uint8_t receiver_credits(Receiver* receiver, int src_id, int queued) {
+    // Everything in recv_map is past the LCA, i.e. out of order
+    int buffered = seq_bitmap_count(&receiver->recv_map[src_id]);
+
+    int credits = RECV_QUEUE_LIMIT - queued - buffered;
+    if (credits < 0) {
+        credits = 0;
+    }
+    if (credits > WINDOW_SIZE - 1) {
+        credits = WINDOW_SIZE - 1;
+    }
+    return credits;
+}
+
+// Seq_nums LCA + 2 onwards that peer's frames are buffered under, see Ack.
+// LCA + 1 is missing, or the LCA would have moved past it.
+static uint8_t receiver_sack(Receiver* receiver, int peer) {
+    uint8_t sack = 0;
+    uint8_t seq_num = next_seq(receiver->LCA[peer]);
+    for (int i = 0; i < 8; i++) {
+        seq_num = next_seq(seq_num);
+        if (seq_bitmap_test(&receiver->recv_map[peer], seq_num)) {
+            sack |= 1u << i;
+        }
+    }
+    return sack;
+}
+
+// Ack for everything received from peer, the virtual source of group
+// traffic, sent to its real source src_id
+static Ack* receiver_ack(Receiver* receiver, int peer, uint8_t src_id,
+                         int queued) {
+    Ack* ack = calloc(1, sizeof(Ack));
+    ack->seq_num = receiver->LCA[peer];
+    ack->src_id = src_id;
+    ack->dst_id = receiver->recv_id;
+    ack->flags = peer >= MAX_CLIENTS ? FRAME_GROUP : 0;
+    ack->window = receiver_credits(receiver, peer, queued);
+    ack->sack = receiver_sack(receiver, peer);
+    return ack;
+}
+
+// Duplex: a data frame from peer src_id acks what this host's sender sent to
+// it. Queue it as a plain ack for that sender; a piggybacked ack always
+// grants a full window.
+static void receiver_host_ack(Receiver* receiver, Frame* frame) {
+    Ack* ack = calloc(1, sizeof(Ack));
+    ack->seq_num = frame->window;
+    ack->src_id = receiver->recv_id;
+    ack->dst_id = frame->src_id;
+    ack->window = WINDOW_SIZE - 1;
+    ll_append_node(&receiver->host_acks, ack);
+}
+
+// Sealed records are never all zero, see ack_seal
+static bool ack_unused(const Ack* ack) {
+    static const Ack empty;
+    return memcmp(ack, &empty, sizeof(Ack)) == 0;
+}
+
+// Put ack into the first unit on *units_head_ptr that has room and holds no
+// ack for the same sender, receiver and group flag, or into a new one
+static void place_ack(LLnode** units_head_ptr, Ack* ack, uint32_t* units) {
+    LLnode* node = *units_head_ptr;
+    Ack* unit = NULL;
+    size_t used = 0;
+    while (node != NULL && unit == NULL) {
+        unit = node->value;
+        for (used = 0; used < ACKS_PER_UNIT && !ack_unused(&unit[used]);
+             used++) {
+            if (unit[used].src_id == ack->src_id &&
+                unit[used].dst_id == ack->dst_id &&
+                unit[used].flags == ack->flags) {
+                unit = NULL;
+                break;
+            }
         }
+        if (used == ACKS_PER_UNIT) {
+            unit = NULL;
+        }
+        node = node->next == *units_head_ptr ? NULL : node->next;
+    }
+    if (unit == NULL) {
+        unit = ack_unit_alloc();
+        ll_append_node(units_head_ptr, unit);
+        used = 0;
+        (*units)++;
+    }
+    unit[used] = *ack;
+    ack_seal(&unit[used]);
+    free(ack);
+}
 
-        if (receiver->frame_buffer[src_id][idx] == NULL) {
-            return max_seq(prev_seq(idx), receiver->LCA[src_id]);
-        } else if (receiver->frame_buffer[src_id][idx]->is_last == 1){
-            return idx;
+// Pack the acks on *acks_head_ptr into channel units and return the list of
+// units. Acks are cumulative, so of the acks for one sender, receiver and
+// group flag only every ACK_STRIDE-th and the last are kept. Keeping more
+// than one, each in its own unit, means one lost unit does not stall a whole
+// window. Acks for different senders share units.
+static LLnode* pack_acks(LLnode** acks_head_ptr, uint32_t* records,
+                         uint32_t* units) {
+    Ack* held[ACK_KEYS] = {NULL};
+    int seen[ACK_KEYS] = {0};
+    LLnode* units_head = NULL;
+    while (*acks_head_ptr != NULL) {
+        LLnode* node = ll_pop_node(acks_head_ptr);
+        Ack* ack = node->value;
+        free(node);
+        int key = ((ack->src_id % MAX_CLIENTS) * MAX_CLIENTS +
+                   ack->dst_id % MAX_CLIENTS) * 2 +
+                  ((ack->flags & FRAME_GROUP) != 0);
+        free(held[key]);
+        held[key] = NULL;
+        if (++seen[key] % ACK_STRIDE == 0) {
+            place_ack(&units_head, ack, units);
+            (*records)++;
+        } else {
+            held[key] = ack;
+        }
+    }
+    for (int key = 0; key < ACK_KEYS; key++) {
+        if (held[key] != NULL) {
+            place_ack(&units_head, held[key], units);
+            (*records)++;
+        }
+    }
+    return units_head;
+}
+
+// Duplex: remember that src_id is owed an ack instead of sending one now
+static void receiver_owe_ack(Receiver* receiver, uint8_t src_id) {
+    if (!(receiver->acks_owed & (1u << src_id))) {
+        receiver->acks_owed |= 1u << src_id;
+        receiver->ack_frames[src_id] = 0;
+        gettimeofday(&receiver->ack_due[src_id], NULL);
+        receiver->ack_due[src_id].tv_usec += ACK_DELAY_USEC;
+        receiver->ack_due[src_id].tv_sec +=
+            receiver->ack_due[src_id].tv_usec / 1000000;
+        receiver->ack_due[src_id].tv_usec %= 1000000;
+    }
+    receiver->ack_frames[src_id]++;
+}
+
+// Duplex: hand the ack owed to src_id to this host's sender, which carries it
+// on its next new data frame to src_id. False if none is owed or if the ack
+// has to advertise less than a full window.
+bool receiver_take_ack(Receiver* receiver, uint8_t src_id, uint8_t* seq_num) {
+    pthread_mutex_lock(&receiver->buffer_mutex);
+    bool owed = (receiver->acks_owed & (1u << src_id)) &&
+                receiver_credits(receiver, src_id, 0) == WINDOW_SIZE - 1;
+    if (owed) {
+        *seq_num = receiver->LCA[src_id];
+        receiver->acks_owed &= ~(1u << src_id);
+        receiver->acks_piggybacked++;
+    }
+    pthread_mutex_unlock(&receiver->buffer_mutex);
+    return owed;
+}
+
+// Send the owed acks that fell due, and pull deadline in to the next one.
+// Caller holds buffer_mutex.
+static void flush_owed_acks(Receiver* receiver, struct timespec* deadline,
+                            LLnode** outgoing_frames_head_ptr) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    for (int src_id = 0; src_id < MAX_CLIENTS; src_id++) {
+        if (!(receiver->acks_owed & (1u << src_id))) {
+            continue;
+        }
+        struct timeval* due = &receiver->ack_due[src_id];
+        if (receiver->stop || timeval_usecdiff(&now, due) <= 0) {
+            receiver->acks_owed &= ~(1u << src_id);
+            ll_append_node(outgoing_frames_head_ptr,
+                           receiver_ack(receiver, src_id, src_id, 0));
+        } else if (due->tv_sec < deadline->tv_sec ||
+                   (due->tv_sec == deadline->tv_sec &&
+                    due->tv_usec * 1000 < deadline->tv_nsec)) {
+            deadline->tv_sec = due->tv_sec;
+            deadline->tv_nsec = due->tv_usec * 1000;
         }
-        idx = next_seq(idx);
     }
 }
 
 void handle_incoming_msgs(Receiver* receiver,
                           LLnode** outgoing_frames_head_ptr) {
     int incoming_msgs_length = ll_get_length(receiver->input_framelist_head);
+    if (incoming_msgs_length == 0) {
+        return;
+    }
+    int frames = incoming_msgs_length;
+    Perf_sample sample;
+    perf_begin(&sample);
 
     while (incoming_msgs_length > 0) {
-        // Pop a node off the front of the link list and update the count
-        LLnode* ll_inmsg_node = ll_pop_node(&receiver->input_framelist_head);
-        incoming_msgs_length = ll_get_length(receiver->input_framelist_head);
-        char* raw_char_buf = ll_inmsg_node->value;
+        // Pop a batch off the front of the link list and validate it at once
+        char* batch[FRAME_BATCH_SIZE];
+        int batch_length = 0;
+        while (batch_length < FRAME_BATCH_SIZE && incoming_msgs_length > 0) {
+            LLnode* ll_inmsg_node = ll_pop_node(&receiver->input_framelist_head);
+            batch[batch_length++] = ll_inmsg_node->value;
+            free(ll_inmsg_node);
+            incoming_msgs_length--;
+        }
 
-        Frame* ingoing_frame = convert_char_to_frame(raw_char_buf);
+        unsigned valid = frame_validate_batch(
+            (Frame* const*) batch, batch_length, receiver->recv_id,
+            glb_senders_array_length);
 
-        free(ll_inmsg_node);
-        free(raw_char_buf);
+        for (int i = 0; i < batch_length; i++) {
+            char* raw_char_buf = batch[i];
+            Frame* ingoing_frame = (Frame*) raw_char_buf;
 
-        // Validate frame
-        if (!(ingoing_frame->dst_id == receiver->recv_id && ingoing_frame->crc == compute_crc(ingoing_frame))) {
-            free(ingoing_frame);
-            continue;
-        }
+            // Validate frame
+            if (!(valid & (1u << i))) {
+                trace_event(TRACE_FRAME_REJECTED, ingoing_frame->src_id,
+                            receiver->recv_id, ingoing_frame->seq_num, 0);
+                free(raw_char_buf);
+                continue;
+            }
+            trace_event(TRACE_FRAME_RECEIVED, ingoing_frame->src_id,
+                        receiver->recv_id, ingoing_frame->seq_num,
+                        ingoing_frame->parity);
+            if (ingoing_frame->parity == 0 &&
+                (ingoing_frame->flags & FRAME_ACK)) {
+                receiver_host_ack(receiver, ingoing_frame);
+            }
 
-        if (within_window(ingoing_frame->seq_num, receiver->LCA[ingoing_frame->src_id])) {
-            // Insert to buffer
-            receiver->frame_buffer[ingoing_frame->src_id][ingoing_frame->seq_num] = malloc(sizeof(Frame));
-            memcpy(receiver->frame_buffer[ingoing_frame->src_id][ingoing_frame->seq_num], ingoing_frame, sizeof(Frame));
+            // File group traffic under its own peer slot. Retransmissions
+            // to a single member carry its recv_id and the group flag.
+            uint8_t src_id = ingoing_frame->src_id;
+            bool group = ingoing_frame->dst_id == GROUP_DST ||
+                         (ingoing_frame->parity == 0 &&
+                          (ingoing_frame->flags & FRAME_GROUP));
+            if (group) {
+                ingoing_frame->src_id += MAX_CLIENTS;
+            }
 
-            // Update LCA
-            uint8_t new_LCA = calc_LCA(receiver, ingoing_frame->src_id, receiver->LCA[ingoing_frame->src_id]);
-            receiver->LCA[ingoing_frame->src_id] = new_LCA;
+            if (ingoing_frame->parity != 0) {
+                if (fec_enabled()) {
+                    fec_store_parity(receiver, ingoing_frame);
+                }
+            } else {
+                arq_policy()->receive(receiver, ingoing_frame);
+            }
 
-            // Check if complete
-            while (receiver->frame_buffer[ingoing_frame->src_id][new_LCA] != NULL && receiver->frame_buffer[ingoing_frame->src_id][new_LCA]->is_last == 1) {
-                char* msg = print_buffer(receiver, ingoing_frame->src_id, receiver->LCA[ingoing_frame->src_id]);
-                clean_buffer(receiver, ingoing_frame->src_id, receiver->LCA[ingoing_frame->src_id]);
-                new_LCA = calc_LCA(receiver, ingoing_frame->src_id, receiver->LCA[ingoing_frame->src_id]);
-                receiver->LCA[ingoing_frame->src_id] = new_LCA;
-                printf("<RECV_%d>:[%s]\n", receiver->recv_id, msg);
-                free(msg);
+            // Rebuild any frame of this group the parity now allows
+            if (fec_enabled()) {
+                Frame* rebuilt;
+                while ((rebuilt = fec_recover(receiver, ingoing_frame->src_id, ingoing_frame->seq_num)) != NULL) {
+                    trace_event(TRACE_FRAME_RECOVERED, rebuilt->src_id,
+                                receiver->recv_id, rebuilt->seq_num, 0);
+                    arq_policy()->receive(receiver, rebuilt);
+                    free(rebuilt);
+                }
             }
-        }
 
-        // Send ack
-        Frame* ack = malloc(sizeof(Frame));
-        ack->seq_num = receiver->LCA[ingoing_frame->src_id];
-        ack->src_id = ingoing_frame->src_id;
-        ack->dst_id = ingoing_frame->dst_id;
+            if (!arq_policy()->acks) {
+                free(raw_char_buf);
+                continue;
+            }
 
-        ll_append_node(outgoing_frames_head_ptr, ack);
+            // Send ack. Frames still waiting in this batch count as queued.
+            // In duplex mode an ack that grants a full window may wait a
+            // little for a data frame going back to src_id.
+            int queued = incoming_msgs_length + batch_length - i - 1;
+            if (glb_sysconfig.duplex && !group) {
+                if (receiver_credits(receiver, src_id, queued) ==
+                    WINDOW_SIZE - 1) {
+                    receiver_owe_ack(receiver, src_id);
+                    if (receiver->ack_frames[src_id] < ACK_MAX_FRAMES) {
+                        free(raw_char_buf);
+                        continue;
+                    }
+                }
+                receiver->acks_owed &= ~(1u << src_id);
+            }
+            ll_append_node(outgoing_frames_head_ptr,
+                           receiver_ack(receiver, ingoing_frame->src_id,
+                                        src_id, queued));
 
-        free(ingoing_frame);
+            free(raw_char_buf);
+        }
     }
+    perf_end(PERF_INCOMING_MSGS, &sample, frames);
+}
+
+// Whether run_receiver has work without waiting. Caller holds buffer_mutex.
+static bool receiver_ready(void* input_receiver) {
+    Receiver* receiver = (Receiver*) input_receiver;
+    return receiver->stop || receiver->input_framelist_head != NULL;
 }
 
 void* run_receiver(void* input_receiver) {
@@ -133,7 +568,11 @@ void* run_receiver(void* input_receiver) {
     const int WAIT_SEC_TIME = 0;
     const long WAIT_USEC_TIME = 100000;
     Receiver* receiver = (Receiver*) input_receiver;
-    LLnode* outgoing_frames_head; // Chanel where all messages will be sent through
+    LLnode* outgoing_frames_head; // Acks to pack into channel units
+    char thread_name[TRACE_NAME_SIZE];
+    snprintf(thread_name, sizeof(thread_name), "receiver %d", receiver->recv_id);
+    trace_thread_name(thread_name);
+    pin_thread(glb_senders_array_length + receiver->recv_id);
 
     while (1) {
         // NOTE: Add outgoing messages to the outgoing_frames_head pointer
@@ -159,35 +598,59 @@ void* run_receiver(void* input_receiver) {
         //      CAN/WILL access these structures
         //*****************************************************************************************
         pthread_mutex_lock(&receiver->buffer_mutex);
+        // Frames already on the channel are still delivered; without acks
+        // the senders cannot wait for them
+        if (receiver->stop && receiver->input_framelist_head == NULL) {
+            pthread_mutex_unlock(&receiver->buffer_mutex);
+            break;
+        }
+
+        if (glb_sysconfig.duplex) {
+            flush_owed_acks(receiver, &time_spec, &outgoing_frames_head);
+        }
 
         // Check whether anything arrived
         int incoming_msgs_length =
             ll_get_length(receiver->input_framelist_head);
-        if (incoming_msgs_length == 0) {
+        if (incoming_msgs_length == 0 && outgoing_frames_head == NULL) {
             // Nothing has arrived, do a timed wait on the condition variable
-            // (which releases the mutex). Again, you don't really need to do
-            // the timed wait. A signal on the condition variable will wake up
-            // the thread and reacquire the lock
-            pthread_cond_timedwait(&receiver->buffer_cv,
-                                   &receiver->buffer_mutex, &time_spec);
+            // (which releases the mutex), spinning first with -spin. A
+            // signal on the condition variable will wake up the thread and
+            // reacquire the lock
+            endpoint_wait(&receiver->buffer_cv, &receiver->buffer_mutex,
+                          &time_spec, receiver_ready, receiver);
         }
 
         handle_incoming_msgs(receiver, &outgoing_frames_head);
+        LLnode* host_acks_head = receiver->host_acks;
+        receiver->host_acks = NULL;
 
         pthread_mutex_unlock(&receiver->buffer_mutex);
 
-        // Send out all the frames user has appended to the outgoing_frames list
-        int ll_outgoing_frame_length = ll_get_length(outgoing_frames_head);
-        while (ll_outgoing_frame_length > 0) {
-            LLnode* ll_outframe_node = ll_pop_node(&outgoing_frames_head);
-            char* char_buf = convert_frame_to_char(ll_outframe_node->value);
+        // Piggybacked acks go straight to this host's sender
+        uint32_t host_records = 0, host_units = 0;
+        LLnode* units_head =
+            pack_acks(&host_acks_head, &host_records, &host_units);
+        while (units_head != NULL) {
+            LLnode* ll_unit_node = ll_pop_node(&units_head);
+            Sender* sender = &glb_senders_array[receiver->recv_id];
+            pthread_mutex_lock(&sender->buffer_mutex);
+            ll_append_node(&sender->input_framelist_head, ll_unit_node->value);
+            pthread_cond_signal(&sender->buffer_cv);
+            pthread_mutex_unlock(&sender->buffer_mutex);
+            free(ll_unit_node);
+        }
 
-            // The following function frees the memory for the char_buf object
-            send_msg_to_senders(char_buf);
-            Frame* frame = ll_outframe_node->value;
-            ll_destroy_node(ll_outframe_node);
+        // Send out all the acks user has appended to the outgoing_frames list,
+        // several to a channel unit
+        units_head = pack_acks(&outgoing_frames_head, &receiver->acks_sent,
+                               &receiver->ack_units);
+        while (units_head != NULL) {
+            LLnode* ll_unit_node = ll_pop_node(&units_head);
 
-            ll_outgoing_frame_length = ll_get_length(outgoing_frames_head);
+            // The following function frees the memory for the unit
+            send_msg_to_senders((char*) ll_unit_node->value);
+            free(ll_unit_node);
         }
     }
     pthread_exit(NULL);
@@ -17,8 +17,19 @@
 #include <unistd.h>
 
 void init_receiver(Receiver*, int);
+void destroy_receiver(Receiver* receiver);
 void* run_receiver(void*);
-void clean_buffer(Receiver* receiver, int src_id, uint8_t last_seq_num);
+void receiver_stop(Receiver* receiver);
+void receiver_set_callback(Receiver* receiver, Recv_callback on_data,
+                           void* ctx);
+void print_message(Receiver* receiver, uint8_t src_id, uint8_t stream_id,
+                   const char* data, size_t length, bool is_last, void* ctx);
 int calc_LCA(Receiver* receiver, int src_id, uint8_t last_seq_num);
-char* print_buffer(Receiver* receiver, int src_id, uint8_t last_seq_num);
+void deliver_frames(Receiver* receiver, int src_id, uint8_t first_seq_num);
+void accept_frame(Receiver* receiver, Frame* frame);
+void receiver_deliver(Receiver* receiver, Frame* frame);
+void receiver_abort_message(Receiver* receiver, uint8_t src_id,
+                            uint8_t stream_id);
+uint8_t receiver_credits(Receiver* receiver, int src_id, int queued);
+bool receiver_take_ack(Receiver* receiver, uint8_t src_id, uint8_t* seq_num);
 #endif
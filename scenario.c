@@ -0,0 +1,440 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "scenario.h"
+#include "communicate.h"
+#include "receiver.h"
+#include "sender.h"
+
+#include <time.h>
+
+enum Scenario_size { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP };
+
+struct Scenario_phase_t {
+    double duration;
+    double rate;
+    bool poisson;
+    enum Scenario_size size_kind;
+    uint32_t size_min;
+    uint32_t size_max;
+    double size_mean;
+    int pair_count;
+    uint8_t pairs[MAX_CLIENTS * MAX_CLIENTS][2];
+    float drop_prob;
+    float corrupt_prob;
+    bool set_drop;
+    bool set_corrupt;
+
+    // Generator side, one slot per sender, each written only by that
+    // sender's generator thread
+    uint32_t sent[MAX_CLIENTS];
+    uint32_t late[MAX_CLIENTS];
+    uint64_t max_lag_ns[MAX_CLIENTS];
+
+    // Receiver side, under scenario_mutex
+    uint64_t* latencies;
+    size_t latency_count;
+    size_t latency_capacity;
+};
+typedef struct Scenario_phase_t Scenario_phase;
+
+// A message whose first chunk has arrived, per receiver, source and stream
+struct Scenario_msg_t {
+    bool started;
+    uint32_t phase;
+    uint64_t due_ns;
+};
+
+static Scenario_phase phases[SCENARIO_MAX_PHASES];
+static int phase_count;
+static struct Scenario_msg_t
+    open_msgs[MAX_CLIENTS][MAX_PEERS][MAX_STREAMS];
+static pthread_mutex_t scenario_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Messages issued this far behind their due time count as late
+#define SCENARIO_LATE_NS 1000000
+
+static uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t when) {
+    struct timespec ts = {when / 1000000000ull, when % 1000000000ull};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+    }
+}
+
+// Uniform in (0, 1]
+static double rng_unit(Rng* rng) {
+    return ((rng_next(rng) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static int parse_map(Scenario_phase* phase, const char* value) {
+    phase->pair_count = 0;
+    if (strcmp(value, "all") == 0) {
+        for (int s = 0; s < glb_senders_array_length; s++) {
+            for (int r = 0; r < glb_receivers_array_length; r++) {
+                phase->pairs[phase->pair_count][0] = s;
+                phase->pairs[phase->pair_count][1] = r;
+                phase->pair_count++;
+            }
+        }
+        return 0;
+    }
+    while (*value != '\0') {
+        int s, r, used;
+        if (sscanf(value, "%d:%d%n", &s, &r, &used) != 2 || s < 0 ||
+            s >= glb_senders_array_length || r < 0 ||
+            r >= glb_receivers_array_length ||
+            phase->pair_count == MAX_CLIENTS * MAX_CLIENTS) {
+            return -1;
+        }
+        phase->pairs[phase->pair_count][0] = s;
+        phase->pairs[phase->pair_count][1] = r;
+        phase->pair_count++;
+        value += used;
+        if (*value == ',') {
+            value++;
+        } else if (*value != '\0') {
+            return -1;
+        }
+    }
+    return phase->pair_count > 0 ? 0 : -1;
+}
+
+static int parse_size(Scenario_phase* phase, const char* value) {
+    unsigned min, max;
+    double mean;
+    char extra;
+    if (sscanf(value, "exp:%lf%c", &mean, &extra) == 1) {
+        phase->size_kind = SIZE_EXP;
+        phase->size_mean = mean;
+        return mean >= 1 ? 0 : -1;
+    }
+    if (sscanf(value, "%u-%u%c", &min, &max, &extra) == 2) {
+        phase->size_kind = SIZE_UNIFORM;
+    } else if (sscanf(value, "%u%c", &min, &extra) == 1) {
+        phase->size_kind = SIZE_FIXED;
+        max = min;
+    } else {
+        return -1;
+    }
+    phase->size_min = min;
+    phase->size_max = max;
+    return min <= max && max <= SCENARIO_MAX_SIZE ? 0 : -1;
+}
+
+static int parse_option(Scenario_phase* phase, char* option) {
+    char* value = strchr(option, '=');
+    char extra;
+    if (value == NULL) {
+        return -1;
+    }
+    *value++ = '\0';
+    if (strcmp(option, "rate") == 0) {
+        return sscanf(value, "%lf%c", &phase->rate, &extra) == 1 &&
+                       phase->rate >= 0
+                   ? 0
+                   : -1;
+    } else if (strcmp(option, "size") == 0) {
+        return parse_size(phase, value);
+    } else if (strcmp(option, "map") == 0) {
+        return parse_map(phase, value);
+    } else if (strcmp(option, "arrivals") == 0) {
+        phase->poisson = strcmp(value, "poisson") == 0;
+        return phase->poisson || strcmp(value, "fixed") == 0 ? 0 : -1;
+    } else if (strcmp(option, "drop") == 0) {
+        phase->set_drop = true;
+        return sscanf(value, "%f%c", &phase->drop_prob, &extra) == 1 &&
+                       phase->drop_prob >= 0 && phase->drop_prob <= 1
+                   ? 0
+                   : -1;
+    } else if (strcmp(option, "corrupt") == 0) {
+        phase->set_corrupt = true;
+        return sscanf(value, "%f%c", &phase->corrupt_prob, &extra) == 1 &&
+                       phase->corrupt_prob >= 0 && phase->corrupt_prob <= 1
+                   ? 0
+                   : -1;
+    }
+    return -1;
+}
+
+// Read every phase up front, so a typo fails the run before it starts.
+// Needs the sender and receiver counts to check map= against.
+int scenario_load(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot open scenario %s\n", path);
+        return -1;
+    }
+
+    char line[1024];
+    int line_no = 0;
+    phase_count = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_no++;
+        char* comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        char* token = strtok(line, " \t\r\n");
+        if (token == NULL) {
+            continue;
+        }
+
+        Scenario_phase* phase = &phases[phase_count];
+        memset(phase, 0, sizeof(*phase));
+        phase->size_kind = SIZE_FIXED;
+        phase->size_min = phase->size_max = 32;
+        phase->pair_count = 1;
+
+        int bad = strcmp(token, "phase") != 0 ||
+                  phase_count == SCENARIO_MAX_PHASES;
+        token = strtok(NULL, " \t\r\n");
+        bad = bad || token == NULL ||
+              sscanf(token, "%lf", &phase->duration) != 1 ||
+              phase->duration <= 0;
+        while (!bad && (token = strtok(NULL, " \t\r\n")) != NULL) {
+            bad = parse_option(phase, token) != 0;
+        }
+        if (bad) {
+            fprintf(stderr, "%s:%d: bad phase\n", path, line_no);
+            fclose(file);
+            return -1;
+        }
+        phase_count++;
+    }
+    fclose(file);
+
+    if (phase_count == 0) {
+        fprintf(stderr, "%s: no phases\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t pick_size(Scenario_phase* phase, Rng* rng) {
+    uint64_t size = phase->size_min;
+    if (phase->size_kind == SIZE_UNIFORM) {
+        size += rng_next(rng) % (phase->size_max - phase->size_min + 1);
+    } else if (phase->size_kind == SIZE_EXP) {
+        size = (uint64_t) (-phase->size_mean * log(rng_unit(rng)));
+        if (size > SCENARIO_MAX_SIZE) {
+            size = SCENARIO_MAX_SIZE;
+        }
+    }
+    return size < SCENARIO_HEADER_SIZE ? SCENARIO_HEADER_SIZE : size;
+}
+
+// Receive callback: note the due time from the first chunk, take the latency
+// on the last
+static void scenario_on_data(Receiver* receiver, uint8_t src_id,
+                             uint8_t stream_id, const char* data,
+                             size_t length, bool is_last, void* ctx) {
+    (void) ctx;
+    struct Scenario_msg_t* msg =
+        &open_msgs[receiver->recv_id][src_id][stream_id];
+    if (data == NULL) {
+        msg->started = false;
+        return;
+    }
+    if (!msg->started) {
+        msg->started = length >= SCENARIO_HEADER_SIZE &&
+                       memcmp(data, SCENARIO_MAGIC, 4) == 0;
+        if (msg->started) {
+            memcpy(&msg->phase, data + 4, sizeof(msg->phase));
+            memcpy(&msg->due_ns, data + 8, sizeof(msg->due_ns));
+        }
+    }
+    if (!is_last || !msg->started) {
+        return;
+    }
+    msg->started = false;
+    if (msg->phase >= (uint32_t) phase_count) {
+        return;
+    }
+
+    uint64_t latency = now_ns() - msg->due_ns;
+    Scenario_phase* phase = &phases[msg->phase];
+    pthread_mutex_lock(&scenario_mutex);
+    if (phase->latency_count == phase->latency_capacity) {
+        phase->latency_capacity =
+            phase->latency_capacity ? 2 * phase->latency_capacity : 256;
+        phase->latencies =
+            realloc(phase->latencies,
+                    phase->latency_capacity * sizeof(*phase->latencies));
+    }
+    phase->latencies[phase->latency_count++] = latency;
+    pthread_mutex_unlock(&scenario_mutex);
+}
+
+// Generate send_id's share of one phase's messages against the phase's fixed
+// schedule. Every generator draws the whole schedule from an identically
+// seeded rng and skips the messages of other senders, so together they offer
+// exactly the phase's load. drop_prob and corrupt_prob hold the channel's
+// current rates, which a phase keeps unless it sets its own.
+static void run_phase(int index, int send_id, uint64_t start, Rng* rng,
+                      char* buf, float* drop_prob, float* corrupt_prob) {
+    Scenario_phase* phase = &phases[index];
+    uint64_t end = start + (uint64_t) (phase->duration * 1e9);
+    uint32_t phase_id = index;
+
+    // The first generator speaks for the phase. The new rates only go to the
+    // channel, which other threads read them from atomically.
+    if (send_id == 0) {
+        if (phase->set_drop || phase->set_corrupt) {
+            if (phase->set_drop) {
+                *drop_prob = phase->drop_prob;
+            }
+            if (phase->set_corrupt) {
+                *corrupt_prob = phase->corrupt_prob;
+            }
+            channel_set_impairments(*drop_prob, *corrupt_prob);
+        }
+        fprintf(stderr,
+                "Scenario phase %d: %.1f msgs/s for %.2fs, drop=%f "
+                "corrupt=%f\n",
+                index + 1, phase->rate, phase->duration, *drop_prob,
+                *corrupt_prob);
+    }
+
+    if (phase->rate <= 0) {
+        sleep_until_ns(end);
+        return;
+    }
+
+    double gap = 1e9 / phase->rate;
+    double offset = phase->poisson ? -gap * log(rng_unit(rng)) : 0;
+    for (uint64_t k = 0;; k++) {
+        uint64_t due = start + (uint64_t) offset;
+        if (due >= end) {
+            break;
+        }
+        uint32_t size = pick_size(phase, rng);
+        offset += phase->poisson ? -gap * log(rng_unit(rng)) : gap;
+        uint8_t* pair = phase->pairs[k % phase->pair_count];
+        if (pair[0] != send_id) {
+            continue;
+        }
+
+        sleep_until_ns(due);
+        uint64_t lag = now_ns() - due;
+        if (lag > SCENARIO_LATE_NS) {
+            phase->late[send_id]++;
+        }
+        if (lag > phase->max_lag_ns[send_id]) {
+            phase->max_lag_ns[send_id] = lag;
+        }
+
+        memcpy(buf, SCENARIO_MAGIC, 4);
+        memcpy(buf + 4, &phase_id, sizeof(phase_id));
+        memcpy(buf + 8, &due, sizeof(due));
+        sender_send(&glb_senders_array[send_id], pair[1], buf, size);
+        phase->sent[send_id]++;
+    }
+    sleep_until_ns(end);
+}
+
+struct Scenario_generator_t {
+    int send_id;
+    uint64_t start;
+};
+
+// Play every phase back to back for one sender. Each phase starts where the
+// last one was due to end, so time lost in a stalled send is not added to the
+// run.
+static void* run_generator(void* arg) {
+    struct Scenario_generator_t* generator = arg;
+    Rng rng;
+    char* buf = malloc(SCENARIO_MAX_SIZE);
+    rng_seed(&rng, glb_sysconfig.seed ^ 0x5343454eull);
+    memset(buf + SCENARIO_HEADER_SIZE, 'x',
+           SCENARIO_MAX_SIZE - SCENARIO_HEADER_SIZE);
+
+    float drop_prob = glb_sysconfig.drop_prob;
+    float corrupt_prob = glb_sysconfig.corrupt_prob;
+    uint64_t start = generator->start;
+    for (int i = 0; i < phase_count; i++) {
+        run_phase(i, generator->send_id, start, &rng, buf, &drop_prob,
+                  &corrupt_prob);
+        start += (uint64_t) (phases[i].duration * 1e9);
+    }
+    free(buf);
+    return NULL;
+}
+
+// Stands in for run_stdinthread: run one generator per sender, so a sender
+// blocked on a full queue only holds back its own messages, then return so
+// main drains and shuts down as it does on exit
+void* run_scenario(void* arg) {
+    (void) arg;
+    pthread_t threads[MAX_CLIENTS];
+    struct Scenario_generator_t generators[MAX_CLIENTS];
+    int i;
+
+    for (i = 0; i < glb_receivers_array_length; i++) {
+        receiver_set_callback(&glb_receivers_array[i], scenario_on_data,
+                              NULL);
+    }
+
+    uint64_t start = now_ns();
+    for (i = 0; i < glb_senders_array_length; i++) {
+        generators[i].send_id = i;
+        generators[i].start = start;
+        int rc = pthread_create(&threads[i], NULL, run_generator,
+                                &generators[i]);
+        if (rc) {
+            fprintf(stderr,
+                    "ERROR; return code from pthread_create() is %d\n", rc);
+            exit(-1);
+        }
+    }
+    for (i = 0; i < glb_senders_array_length; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return NULL;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_ms(Scenario_phase* phase, double p) {
+    size_t idx = (size_t) (p / 100.0 * (phase->latency_count - 1) + 0.5);
+    return phase->latencies[idx] / 1e6;
+}
+
+// Offered load against delivery and latency per phase, once every thread
+// has stopped. Messages count toward the phase they were due in.
+void scenario_report() {
+    for (int i = 0; i < phase_count; i++) {
+        Scenario_phase* phase = &phases[i];
+        uint32_t sent = 0, late = 0;
+        uint64_t max_lag_ns = 0;
+        for (int s = 0; s < glb_senders_array_length; s++) {
+            sent += phase->sent[s];
+            late += phase->late[s];
+            if (phase->max_lag_ns[s] > max_lag_ns) {
+                max_lag_ns = phase->max_lag_ns[s];
+            }
+        }
+        fprintf(stderr,
+                "Scenario phase %d: %u sent (%u late, max lag %.1fms), %zu "
+                "delivered",
+                i + 1, sent, late, max_lag_ns / 1e6, phase->latency_count);
+        if (phase->latency_count > 0) {
+            qsort(phase->latencies, phase->latency_count,
+                  sizeof(*phase->latencies), compare_u64);
+            fprintf(stderr,
+                    ", latency p50 %.1f p90 %.1f p99 %.1f max %.1f ms",
+                    percentile_ms(phase, 50), percentile_ms(phase, 90),
+                    percentile_ms(phase, 99), percentile_ms(phase, 100));
+        }
+        fprintf(stderr, "\n");
+        free(phase->latencies);
+        phase->latencies = NULL;
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef __SCENARIO_H__
+#define __SCENARIO_H__
+
+#include "common.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A scenario file (-a) replaces stdin with timed phases of generated load.
+// One phase per line, blank lines and # comments ignored:
+//   phase <seconds> [rate=<msgs/s>] [size=<n>|<min>-<max>|exp:<mean>]
+//         [map=all|<send_id>:<recv_id>[,...]] [arrivals=fixed|poisson]
+//         [drop=<prob>] [corrupt=<prob>]
+// rate is the total offered load, spread round robin over the map. drop and
+// corrupt change every link's rates when the phase starts and hold until a
+// later phase changes them again.
+//
+// Load is open loop: message k of a phase is due at a time fixed by the
+// schedule, not by when message k-1 went out, and its latency is measured
+// from that due time. Every sender has a generator thread of its own, and a
+// sender that blocks it (a full -qlen queue) shows up as latency of its own
+// messages instead of quietly lowering the load of the others.
+// Every message starts with a SCENARIO_HEADER_SIZE byte header:
+//   magic "TTSC" | phase (4) | due time in ns (8), host byte order
+#define SCENARIO_MAGIC "TTSC"
+#define SCENARIO_HEADER_SIZE 16
+#define SCENARIO_MAX_SIZE 65536
+#define SCENARIO_MAX_PHASES 64
+
+int scenario_load(const char* path);
+void* run_scenario(void*);
+void scenario_report();
+
+#endif
@@ -1,81 +1,572 @@
 #include "sender.h"
+#include "arq.h"
+#include "fec.h"
+#include "perf.h"
+#include "receiver.h"
+#include "trace.h"
 #include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/mman.h>
+
+// Retransmission timeout, from a frame's last transmission
+#define RETX_TIMEOUT_USEC 90000
+
+// Multipath striping: EWMA gains of the per-link estimates, the RTT a link
+// starts out with, and the least weight a link keeps however lossy it looks,
+// so it is still probed and its estimate can recover
+#define LINK_LOSS_GAIN 0.0625
+#define LINK_RTT_GAIN 0.125
+#define LINK_INITIAL_RTT 1000.0
+#define LINK_MIN_WEIGHT 0.02
+
+// Pacing: frames a destination may send back to back, and how far above
+// cwnd per RTT the estimated rate runs so pacing does not become the
+// bottleneck itself
+#define PACE_BURST 2.0
+#define PACE_GAIN 1.25
 
 void init_sender(Sender* sender, int id) {
     pthread_cond_init(&sender->buffer_cv, NULL);
+    pthread_cond_init(&sender->framer_cv, NULL);
+    pthread_cond_init(&sender->space_cv, NULL);
     pthread_mutex_init(&sender->buffer_mutex, NULL);
+    pthread_mutex_init(&sender->done_mutex, NULL);
     sender->send_id = id;
     sender->input_cmdlist_head = NULL;
     sender->input_framelist_head = NULL;
-    gettimeofday(&sender->timeout, NULL);
 
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        sender->timeout = NULL;
-        sender->frame_buffer[i] = NULL;
+    for (int i = 0; i < MAX_DESTS; i++) {
+        for (int j = 0; j < WINDOW_SIZE; j++) {
+            sender->tx_slots[i][j].frame = NULL;
+        }
+        for (int p = 0; p < NUM_PRIORITIES; p++) {
+            sender->cmd_queue[i][p] = NULL;
+            sender->current_cmd[i][p] = NULL;
+            sender->current_offset[i][p] = 0;
+        }
+        sender->frame_seq[i] = 0;
+        sender->frames_cut[i] = 0;
+        for (int j = 0; j < MAX_STREAMS; j++) {
+            sender->stream_last[i][j] = 0;
+        }
+        ring_init(&sender->framed[i]);
+        sender->deficit[i] = 0;
         sender->LAR[i] = 0;
         sender->LFS[i] = 0;
+        seq_bitmap_init(&sender->unacked[i]);
+        sender->rwnd[i] = WINDOW_SIZE - 1;
+        sender->cwnd[i] = 2;
+        sender->cwnd_recover[i] = 0;
+        sender->pace_tokens[i] = PACE_BURST;
+        gettimeofday(&sender->pace_stamp[i], NULL);
+        sender->srtt[i] = LINK_INITIAL_RTT;
+        sender->done[i] = NULL;
+    }
+    sender->on_sent = NULL;
+    sender->on_sent_ctx = NULL;
+    sender->group_members = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (i < glb_receivers_array_length) {
+            sender->group_members |= 1u << i;
+        }
+        sender->group_acked[i] = 0;
+        sender->group_rwnd[i] = WINDOW_SIZE - 1;
+    }
+    sender->group_msgs = 0;
+    for (int l = 0; l < MAX_LINKS; l++) {
+        sender->link_loss[l] = 0;
+        sender->link_rtt[l] = LINK_INITIAL_RTT;
+        sender->link_credit[l] = 0;
+        sender->link_frames[l] = 0;
+    }
+    sender->rr_next = 0;
+    sender->next_msg_id = 0;
+    sender->queued_cmds = 0;
+    sender->queued_bytes = 0;
+    sender->queued_cmds_peak = 0;
+    sender->queued_bytes_peak = 0;
+    sender->queue_stalls = 0;
+    sender->unqueued_cmds = 0;
+    sender->unqueued_bytes = 0;
+    sender->draining = false;
+    sender->stop = false;
+    sender->framing = false;
+    fec_init_sender(sender);
+}
+
+// Free everything the sender still holds. Its threads must have been joined.
+void destroy_sender(Sender* sender) {
+    while (sender->input_cmdlist_head != NULL) {
+        LLnode* node = ll_pop_node(&sender->input_cmdlist_head);
+        cmd_free(node->value);
+        free(node);
+    }
+    ll_free_list(&sender->input_framelist_head);
+    for (int i = 0; i < MAX_DESTS; i++) {
+        for (int p = 0; p < NUM_PRIORITIES; p++) {
+            while (sender->cmd_queue[i][p] != NULL) {
+                LLnode* node = ll_pop_node(&sender->cmd_queue[i][p]);
+                cmd_free(node->value);
+                free(node);
+            }
+            if (sender->current_cmd[i][p] != NULL) {
+                cmd_free(sender->current_cmd[i][p]);
+                sender->current_cmd[i][p] = NULL;
+            }
+        }
+        ll_free_list(&sender->done[i]);
+        while (ring_count(&sender->framed[i]) > 0) {
+            free(ring_pop(&sender->framed[i]));
+        }
+        for (int j = 0; j < WINDOW_SIZE; j++) {
+            free(sender->tx_slots[i][j].frame);
+            sender->tx_slots[i][j].frame = NULL;
+        }
     }
+    pthread_cond_destroy(&sender->buffer_cv);
+    pthread_cond_destroy(&sender->framer_cv);
+    pthread_cond_destroy(&sender->space_cv);
+    pthread_mutex_destroy(&sender->buffer_mutex);
+    pthread_mutex_destroy(&sender->done_mutex);
 }
 
-struct timeval* sender_get_next_expiring_timeval(Sender* sender) {
-    // TODO: You should fill in this function so that it returns the next
-    // timeout that should occur
-    if (sender->timeout == NULL) {
-        return NULL;
+// Queue len bytes of buf for dst_id. The buffer is copied, so it may hold
+// binary data and can be reused once this returns.
+int sender_send(Sender* sender, uint16_t dst_id, const char* buf, size_t len) {
+    return sender_send_stream(sender, dst_id, STREAM_DEFAULT, buf, len,
+                              PRIO_NORMAL);
+}
+
+void cmd_free(Cmd* cmd) {
+    if (cmd->mapped) {
+        munmap(cmd->message, cmd->length - cmd->header_length);
+    } else {
+        free(cmd->message);
     }
+    free(cmd->header);
+    free(cmd);
+}
 
-    while (sender->timeout != NULL) {
-        Frame expiring_frame = ((Timed_frame*) sender->timeout->value)->frame;
-        if (within_window(expiring_frame.seq_num,
-                          sender->LAR[expiring_frame.dst_id])) {
-            return &((Timed_frame*) sender->timeout->value)->timeout;
-        } else {
-            ll_destroy_node(ll_pop_node(&sender->timeout));
+// Whether cmd fits in the queue budgets. A command larger than the byte
+// budget is let in once the queue is empty. Caller holds buffer_mutex.
+static bool queue_has_room(Sender* sender, Cmd* cmd) {
+    if (sender->queued_cmds == 0) {
+        return true;
+    }
+    return sender->queued_cmds < (uint32_t) glb_sysconfig.queue_cmds &&
+           sender->queued_bytes + cmd->length <= glb_sysconfig.queue_bytes;
+}
+
+// Hand a command to the sender thread, waiting while the queue budgets are
+// used up. Takes ownership of cmd.
+static int sender_enqueue(Sender* sender, Cmd* cmd) {
+    // Lock the buffer, add to the input list, and signal the thread
+    pthread_mutex_lock(&sender->buffer_mutex);
+    if (!sender->draining && !queue_has_room(sender, cmd)) {
+        sender->queue_stalls++;
+        while (!sender->draining && !sender->stop &&
+               !queue_has_room(sender, cmd)) {
+            pthread_cond_wait(&sender->space_cv, &sender->buffer_mutex);
         }
     }
+    if (sender->draining || sender->stop) {
+        pthread_mutex_unlock(&sender->buffer_mutex);
+        cmd_free(cmd);
+        return -1;
+    }
+    sender->queued_cmds++;
+    sender->queued_bytes += cmd->length;
+    if (sender->queued_cmds > sender->queued_cmds_peak) {
+        sender->queued_cmds_peak = sender->queued_cmds;
+    }
+    if (sender->queued_bytes > sender->queued_bytes_peak) {
+        sender->queued_bytes_peak = sender->queued_bytes;
+    }
+    cmd->msg_id = sender->next_msg_id++;
+    if (cmd->dst_id == GROUP_DST) {
+        sender->group_msgs++;
+    }
+    trace_event(TRACE_MSG_QUEUED, sender->send_id, cmd->dst_id, cmd->priority,
+                cmd->msg_id);
+    ll_append_node(&sender->input_cmdlist_head, cmd);
+    pthread_cond_signal(&sender->buffer_cv);
+    pthread_cond_signal(&sender->framer_cv);
+    pthread_mutex_unlock(&sender->buffer_mutex);
+    return 0;
 }
 
-void handle_incoming_acks(Sender* sender, LLnode** outgoing_frames_head_ptr) {
-    int input_length = ll_get_length(sender->input_framelist_head);
-    if (input_length == 0) {
-        return;
+static bool valid_dst(uint16_t dst_id, uint8_t stream_id, uint8_t priority) {
+    return dst_id < glb_receivers_array_length && dst_id < MAX_CLIENTS &&
+           stream_id < MAX_STREAMS && priority < NUM_PRIORITIES;
+}
+
+// Same as sender_send, lower priority values are framed first
+int sender_send_prio(Sender* sender, uint16_t dst_id, const char* buf,
+                     size_t len, uint8_t priority) {
+    return sender_send_stream(sender, dst_id, STREAM_DEFAULT, buf, len,
+                              priority);
+}
+
+// Same as sender_send_prio on one of the MAX_STREAMS streams to dst_id.
+// Messages are delivered in order within a stream, but a loss on one stream
+// does not hold back the others.
+int sender_send_stream(Sender* sender, uint16_t dst_id, uint8_t stream_id,
+                       const char* buf, size_t len, uint8_t priority) {
+    return sender_submit(sender, dst_id, stream_id, buf, len, priority, NULL);
+}
+
+// Same as sender_send_stream, and on_sent gets user back once the message is
+// acked. A message that is refused (-1) never reaches on_sent.
+int sender_submit(Sender* sender, uint16_t dst_id, uint8_t stream_id,
+                  const char* buf, size_t len, uint8_t priority, void* user) {
+    if (!valid_dst(dst_id, stream_id, priority)) {
+        return -1;
     }
-    LLnode* input_node = ll_pop_node(&sender->input_framelist_head);
 
-    Frame* ack = input_node->value;
-    if (!(ack->src_id == sender->send_id &&
-          within_window(ack->seq_num, sender->LAR[ack->dst_id]))) {
-        ll_destroy_node(input_node);
+    Cmd* outgoing_cmd = calloc(1, sizeof(Cmd));
+    outgoing_cmd->src_id = sender->send_id;
+    outgoing_cmd->dst_id = dst_id;
+    outgoing_cmd->message = malloc(len > 0 ? len : 1);
+    outgoing_cmd->length = len;
+    outgoing_cmd->priority = priority;
+    outgoing_cmd->stream_id = stream_id;
+    outgoing_cmd->user = user;
+    memcpy(outgoing_cmd->message, buf, len);
+    return sender_enqueue(sender, outgoing_cmd);
+}
+
+// Completion callback for every message acked from now on. Set it before the
+// sender thread starts: the framer reads it without the lock.
+void sender_set_callback(Sender* sender, Send_callback on_sent, void* ctx) {
+    pthread_mutex_lock(&sender->buffer_mutex);
+    sender->on_sent = on_sent;
+    sender->on_sent_ctx = ctx;
+    pthread_mutex_unlock(&sender->buffer_mutex);
+}
+
+struct Send_done_t {
+    uint8_t seq_num; // last frame of the message
+    void* user;
+};
+
+// Framer: remember which seq_num completes a message before its last frame
+// is handed over
+static void sender_note_done(Sender* sender, uint8_t dst_id, uint8_t seq_num,
+                             void* user) {
+    struct Send_done_t* done = malloc(sizeof(struct Send_done_t));
+    done->seq_num = seq_num;
+    done->user = user;
+    pthread_mutex_lock(&sender->done_mutex);
+    ll_append_node(&sender->done[dst_id], done);
+    pthread_mutex_unlock(&sender->done_mutex);
+}
+
+// Report the messages whose last frame lies in (from, to]. Entries are in
+// seq_num order, so this stops at the first one further out.
+static void sender_complete(Sender* sender, uint8_t dst_id, uint8_t from,
+                            uint8_t to) {
+    if (sender->on_sent == NULL) {
         return;
     }
+    int acked = seq_distance(from, to);
+    pthread_mutex_lock(&sender->done_mutex);
+    while (sender->done[dst_id] != NULL) {
+        struct Send_done_t* done = sender->done[dst_id]->value;
+        int distance = seq_distance(from, done->seq_num);
+        if (distance == 0 || distance > acked) {
+            break;
+        }
+        LLnode* node = ll_pop_node(&sender->done[dst_id]);
+        sender->on_sent(sender, dst_id, done->user, true,
+                        sender->on_sent_ctx);
+        free(done);
+        free(node);
+    }
+    pthread_mutex_unlock(&sender->done_mutex);
+}
+
+// Same as sender_send_stream for every receiver at once: the message is framed
+// and put on the channel once, and only receivers that miss a frame get it
+// again
+int sender_send_group(Sender* sender, uint8_t stream_id, const char* buf,
+                      size_t len, uint8_t priority) {
+    if (stream_id >= MAX_STREAMS || priority >= NUM_PRIORITIES) {
+        return -1;
+    }
+
+    Cmd* outgoing_cmd = calloc(1, sizeof(Cmd));
+    outgoing_cmd->src_id = sender->send_id;
+    outgoing_cmd->dst_id = GROUP_DST;
+    outgoing_cmd->message = malloc(len > 0 ? len : 1);
+    outgoing_cmd->length = len;
+    outgoing_cmd->priority = priority;
+    outgoing_cmd->stream_id = stream_id;
+    memcpy(outgoing_cmd->message, buf, len);
+    return sender_enqueue(sender, outgoing_cmd);
+}
 
-    sender->LAR[ack->dst_id] = ack->seq_num;
+// Queue a header followed by len bytes of an mmap'd region as one message.
+// Both are framed straight from where they are: the sender takes ownership
+// of header (malloc'd) and of the mapping, which it munmaps once framed.
+int sender_send_mapped(Sender* sender, uint16_t dst_id, uint8_t stream_id,
+                       char* header, size_t header_len, char* mapping,
+                       size_t len, uint8_t priority) {
+    if (!valid_dst(dst_id, stream_id, priority)) {
+        free(header);
+        if (mapping != NULL) {
+            munmap(mapping, len);
+        }
+        return -1;
+    }
 
-    int buffered = ll_get_length(sender->frame_buffer[ack->dst_id]);
+    Cmd* outgoing_cmd = calloc(1, sizeof(Cmd));
+    outgoing_cmd->src_id = sender->send_id;
+    outgoing_cmd->dst_id = dst_id;
+    outgoing_cmd->header = header;
+    outgoing_cmd->header_length = header_len;
+    outgoing_cmd->message = mapping;
+    outgoing_cmd->mapped = mapping != NULL;
+    outgoing_cmd->length = header_len + len;
+    outgoing_cmd->priority = priority;
+    outgoing_cmd->stream_id = stream_id;
+    return sender_enqueue(sender, outgoing_cmd);
+}
 
-    // Send buffered frames
-    while (buffered > 0) {
-        LLnode* next_frame_node = sender->frame_buffer[ack->dst_id];
-        Frame* next_frame = next_frame_node->value;
+// Slot of an in-flight seq_num. Fewer than WINDOW_SIZE consecutive seq_nums
+// are ever in flight, and skipping seq_num 0 at the wrap cannot make two of
+// them share a slot.
+Tx_slot* sender_tx_slot(Sender* sender, uint8_t dst_id, uint8_t seq_num) {
+    return &sender->tx_slots[dst_id][seq_num % WINDOW_SIZE];
+}
 
-        if (!within_window(next_frame->seq_num, sender->LAR[ack->dst_id])) {
-            break;
+// Unacked frame that times out first, or NULL if nothing is in flight
+Tx_slot* sender_get_next_expiring_slot(Sender* sender) {
+    Tx_slot* next = NULL;
+    for (int dst_id = 0; dst_id < MAX_DESTS; dst_id++) {
+        if (sender->LFS[dst_id] == sender->LAR[dst_id]) {
+            continue;
+        }
+        for (int i = 0; i < WINDOW_SIZE; i++) {
+            Tx_slot* slot = &sender->tx_slots[dst_id][i];
+            if (slot->frame != NULL &&
+                (next == NULL ||
+                 timeval_usecdiff(&slot->timeout, &next->timeout) > 0)) {
+                next = slot;
+            }
+        }
+    }
+    return next;
+}
+
+// Frames allowed in flight to dst_id: the smallest of the congestion window,
+// the receiver's advertised credits and the sequence window
+int send_window(Sender* sender, uint8_t dst_id) {
+    int window = (int) sender->cwnd[dst_id];
+    if (sender->rwnd[dst_id] < window) {
+        window = sender->rwnd[dst_id];
+    }
+    if (window > WINDOW_SIZE - 1) {
+        window = WINDOW_SIZE - 1;
+    }
+    // Keep one frame going when the receiver is full so it can reopen
+    if (window < 1) {
+        window = 1;
+    }
+    return window;
+}
+
+bool within_send_window(Sender* sender, uint8_t dst_id, uint8_t seq_num) {
+    int distance = seq_distance(sender->LAR[dst_id], seq_num);
+    return distance > 0 && distance <= send_window(sender, dst_id);
+}
+
+// Link for the next transmission, by smooth weighted round robin. A link's
+// weight is its delivery rate, to the fourth power so a lossy link sheds
+// traffic quickly, over its RTT.
+int sender_pick_link(Sender* sender) {
+    int best = 0;
+    double total = 0;
+    for (int l = 0; l < glb_sysconfig.link_count; l++) {
+        double delivered = 1 - sender->link_loss[l];
+        double weight = delivered * delivered * delivered * delivered;
+        if (weight < LINK_MIN_WEIGHT) {
+            weight = LINK_MIN_WEIGHT;
+        }
+        weight /= sender->link_rtt[l];
+        sender->link_credit[l] += weight;
+        total += weight;
+        if (sender->link_credit[l] > sender->link_credit[best]) {
+            best = l;
+        }
+    }
+    sender->link_credit[best] -= total;
+    sender->link_frames[best]++;
+    return best;
+}
+
+// Time since the slot's frame was last sent, in usec
+static double slot_rtt(Tx_slot* slot) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    double rtt = timeval_usecdiff(&slot->timeout, &now) + RETX_TIMEOUT_USEC;
+    return rtt < 1 ? 1 : rtt;
+}
+
+// Fold an acked or timed out transmission into its link's estimates. RTT is
+// only sampled from the frame an ack names, since the frames it covers
+// before that may have sat out of order at the receiver, and only if it was
+// sent once, as the ack of a resent frame may answer either copy.
+static void link_observe(Sender* sender, Tx_slot* slot, bool lost,
+                         bool sample_rtt) {
+    uint8_t l = slot->link;
+    sender->link_loss[l] += LINK_LOSS_GAIN * ((lost ? 1 : 0) -
+                                              sender->link_loss[l]);
+    if (lost || !sample_rtt || slot->sends != 1) {
+        return;
+    }
+    sender->link_rtt[l] += LINK_RTT_GAIN * (slot_rtt(slot) -
+                                            sender->link_rtt[l]);
+}
+
+// Everything up to seq_num has been acked by every receiver it went to
+static void sender_advance_LAR(Sender* sender, uint8_t dst_id,
+                               uint8_t seq_num) {
+    // Additive increase, roughly one frame per window of acks
+    int acked = seq_distance(sender->LAR[dst_id], seq_num);
+    if (acked == 0) {
+        return;
+    }
+    sender->cwnd[dst_id] += (double) acked / sender->cwnd[dst_id];
+    if (sender->cwnd[dst_id] > WINDOW_SIZE - 1) {
+        sender->cwnd[dst_id] = WINDOW_SIZE - 1;
+    }
+    seq_bitmap_clear_range(&sender->unacked[dst_id], sender->LAR[dst_id],
+                           seq_num);
+    for (uint8_t idx = sender->LAR[dst_id]; idx != seq_num;) {
+        idx = next_seq(idx);
+        Tx_slot* slot = sender_tx_slot(sender, dst_id, idx);
+        if (glb_sysconfig.link_count > 1) {
+            link_observe(sender, slot, false, idx == seq_num);
         }
+        // Same sampling rule as link_observe
+        if (idx == seq_num && slot->sends == 1) {
+            sender->srtt[dst_id] +=
+                LINK_RTT_GAIN * (slot_rtt(slot) - sender->srtt[dst_id]);
+        }
+        free(slot->frame);
+        slot->frame = NULL;
+    }
+    trace_event(TRACE_FRAME_ACKED, sender->send_id, dst_id, seq_num, acked);
+    sender_complete(sender, dst_id, sender->LAR[dst_id], seq_num);
+    sender->LAR[dst_id] = seq_num;
+}
+
+// A member's cumulative ack clears its bit in every slot it covers. The group
+// LAR moves up to the first frame some member still misses, and the group
+// window follows the member with the fewest credits.
+static void handle_group_ack(Sender* sender, Ack* ack) {
+    uint8_t member = ack->dst_id;
+    if (member >= MAX_CLIENTS || !(sender->group_members & (1u << member))) {
+        return;
+    }
+    uint8_t acked = sender->group_acked[member];
+    if (ack->seq_num == 0 || seq_distance(acked, ack->seq_num) >
+        seq_distance(acked, sender->LFS[GROUP_DST])) {
+        return;
+    }
+    for (uint8_t seq_num = acked; seq_num != ack->seq_num;) {
+        seq_num = next_seq(seq_num);
+        sender_tx_slot(sender, GROUP_DST, seq_num)->pending &= ~(1u << member);
+    }
+    sender->group_acked[member] = ack->seq_num;
+    sender->group_rwnd[member] = ack->window;
+
+    uint8_t LAR = sender->LAR[GROUP_DST];
+    while (LAR != sender->LFS[GROUP_DST] &&
+           sender_tx_slot(sender, GROUP_DST, next_seq(LAR))->pending == 0) {
+        LAR = next_seq(LAR);
+    }
+    sender_advance_LAR(sender, GROUP_DST, LAR);
 
-        ll_append_node(outgoing_frames_head_ptr, copy_frame(next_frame));
-        ll_pop_node(&sender->frame_buffer[ack->dst_id]);
-        ll_destroy_node(next_frame_node);
-        buffered--;
+    uint8_t rwnd = WINDOW_SIZE - 1;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if ((sender->group_members & (1u << i)) &&
+            sender->group_rwnd[i] < rwnd) {
+            rwnd = sender->group_rwnd[i];
+        }
     }
+    sender->rwnd[GROUP_DST] = rwnd;
+}
 
-    ll_destroy_node(input_node);
+// Mark the frames the receiver holds out of order past seq_num, see Ack
+static void sender_sack(Sender* sender, uint8_t dst_id, uint8_t seq_num,
+                        uint8_t sack) {
+    int in_flight = seq_distance(sender->LAR[dst_id], sender->LFS[dst_id]);
+    seq_num = next_seq(seq_num);
+    for (; sack != 0; sack >>= 1) {
+        seq_num = next_seq(seq_num);
+        if (!(sack & 1) ||
+            seq_distance(sender->LAR[dst_id], seq_num) > in_flight) {
+            continue;
+        }
+        Tx_slot* slot = sender_tx_slot(sender, dst_id, seq_num);
+        if (slot->frame != NULL && slot->frame->seq_num == seq_num) {
+            slot->sacked = true;
+        }
+    }
 }
 
-void handle_input_cmds(Sender* sender, LLnode** outgoing_frames_head_ptr) {
+// Every channel unit holds up to ACKS_PER_UNIT records for any sender. Only
+// those addressed to this sender that pass their check are used.
+void handle_incoming_acks(Sender* sender) {
+    int input_length = ll_get_length(sender->input_framelist_head);
+    if (input_length == 0) {
+        return;
+    }
+    int acks = 0;
+    Perf_sample sample;
+    perf_begin(&sample);
+    while (input_length > 0) {
+        LLnode* input_node = ll_pop_node(&sender->input_framelist_head);
+        input_length--;
+
+        Ack* unit = input_node->value;
+        for (size_t i = 0; i < ACKS_PER_UNIT; i++) {
+            Ack* ack = &unit[i];
+            if (ack->src_id != sender->send_id || !ack_crc_ok(ack)) {
+                continue;
+            }
+            acks++;
+            uint8_t dst_id = ack->dst_id;
+            if (ack->flags & FRAME_GROUP) {
+                handle_group_ack(sender, ack);
+            } else if (dst_id < MAX_CLIENTS && ack->seq_num != 0 &&
+                       seq_distance(sender->LAR[dst_id], ack->seq_num) <=
+                           seq_distance(sender->LAR[dst_id],
+                                        sender->LFS[dst_id])) {
+                sender_advance_LAR(sender, dst_id, ack->seq_num);
+                sender->rwnd[dst_id] = ack->window;
+                sender_sack(sender, dst_id, ack->seq_num, ack->sack);
+            }
+        }
+
+        free(unit);
+        free(input_node);
+    }
+    perf_end(PERF_INCOMING_ACKS, &sample, acks);
+}
 
+// Move new commands into the per-destination, per-class queues. Frames are
+// only cut from them by schedule_frames once the window has room.
+void handle_input_cmds(Sender* sender) {
     int input_cmd_length = ll_get_length(sender->input_cmdlist_head);
+    if (input_cmd_length == 0) {
+        return;
+    }
+    int cmds = input_cmd_length;
+    Perf_sample sample;
+    perf_begin(&sample);
     while (input_cmd_length > 0) {
         // Pop a node off and update the input_cmd_length
         LLnode* ll_input_cmd_node = ll_pop_node(&sender->input_cmdlist_head);
@@ -85,79 +576,531 @@ void handle_input_cmds(Sender* sender, LLnode** outgoing_frames_head_ptr) {
         Cmd* outgoing_cmd = (Cmd*) ll_input_cmd_node->value;
         free(ll_input_cmd_node);
 
-        // Ignore if message src is wrong
-        if (outgoing_cmd->src_id != sender->send_id) {
-            free(outgoing_cmd->message);
-            free(outgoing_cmd);
+        // Ignore if message src is wrong or there is nothing to send
+        if (outgoing_cmd->src_id != sender->send_id ||
+            outgoing_cmd->dst_id >= MAX_DESTS || outgoing_cmd->length == 0) {
+            sender->unqueued_cmds++;
+            sender->unqueued_bytes += outgoing_cmd->length;
+            cmd_free(outgoing_cmd);
             continue;
         }
 
-        int msg_length = strlen(outgoing_cmd->message);
-        int remaining = msg_length;
-        int seq_num = next_seq(sender->LFS[outgoing_cmd->dst_id]);
-        bool is_first = true;
+        ll_append_node(&sender->cmd_queue[outgoing_cmd->dst_id]
+                                         [outgoing_cmd->priority],
+                       outgoing_cmd);
+    }
+    perf_end(PERF_INPUT_CMDS, &sample, cmds);
+}
+
+bool sender_has_pending(Sender* sender, uint8_t dst_id) {
+    for (int p = 0; p < NUM_PRIORITIES; p++) {
+        if (sender->current_cmd[dst_id][p] != NULL ||
+            sender->cmd_queue[dst_id][p] != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool stream_busy(Sender* sender, uint8_t dst_id, uint8_t stream_id) {
+    for (int p = 0; p < NUM_PRIORITIES; p++) {
+        Cmd* cmd = sender->current_cmd[dst_id][p];
+        if (cmd != NULL && cmd->stream_id == stream_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Class whose message is framed next for dst_id. A higher class may cut into
+// a lower one's message, but only on a stream no started message is using,
+// since the receiver reassembles each stream in sequence order.
+int next_class(Sender* sender, uint8_t dst_id) {
+    for (int p = 0; p < NUM_PRIORITIES; p++) {
+        if (sender->current_cmd[dst_id][p] != NULL) {
+            return p;
+        }
+        LLnode* head = sender->cmd_queue[dst_id][p];
+        if (head != NULL &&
+            !stream_busy(sender, dst_id, ((Cmd*) head->value)->stream_id)) {
+            LLnode* node = ll_pop_node(&sender->cmd_queue[dst_id][p]);
+            sender->current_cmd[dst_id][p] = node->value;
+            sender->current_offset[dst_id][p] = 0;
+            free(node);
+            return p;
+        }
+    }
+    return -1;
+}
+
+// Cut the next frame of the current message for dst_id
+Frame* frame_next_chunk(Sender* sender, uint8_t dst_id) {
+    int prio = next_class(sender, dst_id);
+    Cmd* outgoing_cmd = sender->current_cmd[dst_id][prio];
+    size_t idx = sender->current_offset[dst_id][prio];
+    size_t remaining = outgoing_cmd->length - idx;
+    Frame* outgoing_frame = frame_alloc();
 
-        while (remaining > 0) {
-            Frame* outgoing_frame = calloc(MAX_FRAME_SIZE, sizeof(char));
-            int idx = msg_length - remaining;
+    // create frame
+    outgoing_frame->src_id = outgoing_cmd->src_id;
+    outgoing_frame->dst_id = outgoing_cmd->dst_id;
+    outgoing_frame->seq_num = next_seq(sender->frame_seq[dst_id]);
+    outgoing_frame->stream_id = outgoing_cmd->stream_id;
+    outgoing_frame->flags = idx == 0 ? FRAME_FIRST : 0;
+    if (dst_id == GROUP_DST) {
+        outgoing_frame->flags |= FRAME_GROUP;
+    }
 
-            // create frame
-            outgoing_frame->src_id = outgoing_cmd->src_id;
-            outgoing_frame->dst_id = outgoing_cmd->dst_id;
-            outgoing_frame->seq_num = seq_num;
+    // Determine if last frame
+    if (remaining > FRAME_PAYLOAD_SIZE) {
+        outgoing_frame->length = FRAME_PAYLOAD_SIZE;
+    } else {
+        outgoing_frame->flags |= FRAME_LAST;
+        outgoing_frame->length = remaining;
+    }
 
-            if (is_first) {
-                outgoing_frame->is_first = 1;
-                is_first = false;
-            }
+    // Point back at the previous frame of the stream while it can still be
+    // inside the receiver's window; anything older is already contiguous
+    uint32_t cut = ++sender->frames_cut[dst_id];
+    uint32_t* last = &sender->stream_last[dst_id][outgoing_cmd->stream_id];
+    if (*last != 0 && cut - *last < WINDOW_SIZE) {
+        outgoing_frame->flags |= (cut - *last) << FRAME_PREV_SHIFT;
+    }
+    *last = cut;
 
-            // Determine if last frame
-            if (remaining > FRAME_PAYLOAD_SIZE) {
-                outgoing_frame->is_last = 0;
-                outgoing_frame->length = FRAME_PAYLOAD_SIZE;
-                remaining -= FRAME_PAYLOAD_SIZE;
-            } else {
-                outgoing_frame->is_last = 1;
-                outgoing_frame->length = remaining; // +1 for null terminator
-                remaining = 0;
-            }
+    // Copy data, from the header first if there is one
+    size_t copied = 0;
+    if (idx < outgoing_cmd->header_length) {
+        copied = outgoing_cmd->header_length - idx;
+        if (copied > outgoing_frame->length) {
+            copied = outgoing_frame->length;
+        }
+        memcpy(outgoing_frame->data, outgoing_cmd->header + idx, copied);
+    }
+    if (outgoing_frame->length > copied) {
+        memcpy(outgoing_frame->data + copied,
+               outgoing_cmd->message + idx + copied -
+                   outgoing_cmd->header_length,
+               outgoing_frame->length - copied);
+    }
+
+    // Append CRC
+    frame_seal(outgoing_frame);
+    trace_event(TRACE_FRAME_CREATED, outgoing_frame->src_id, dst_id,
+                outgoing_frame->seq_num, outgoing_cmd->msg_id);
+
+    sender->frame_seq[dst_id] = outgoing_frame->seq_num;
+    sender->current_offset[dst_id][prio] += outgoing_frame->length;
+    sender->unqueued_bytes += outgoing_frame->length;
+    if (outgoing_frame->flags & FRAME_LAST) {
+        if (sender->on_sent != NULL) {
+            sender_note_done(sender, dst_id, outgoing_frame->seq_num,
+                             outgoing_cmd->user);
+        }
+        sender->unqueued_cmds++;
+        cmd_free(outgoing_cmd);
+        sender->current_cmd[dst_id][prio] = NULL;
+    }
+    return outgoing_frame;
+}
+
+// Whether the framer may cut another frame for dst_id, see FRAME_LOOKAHEAD
+static bool frame_room(Sender* sender, uint8_t dst_id) {
+    return ring_count(&sender->framed[dst_id]) < FRAME_LOOKAHEAD;
+}
+
+// Framing stage: cut and checksum frames for every destination until it has a
+// window's worth framed ahead. Returns whether anything was framed.
+bool frame_ahead(Sender* sender) {
+    int framed = 0;
+    Perf_sample sample;
+    perf_begin(&sample);
+    for (int dst_id = 0; dst_id < MAX_DESTS; dst_id++) {
+        while (frame_room(sender, dst_id) &&
+               sender_has_pending(sender, dst_id)) {
+            ring_push(&sender->framed[dst_id], frame_next_chunk(sender, dst_id));
+            framed++;
+        }
+    }
+    if (framed > 0) {
+        perf_end(PERF_FRAMING, &sample, framed);
+    }
+    return framed > 0;
+}
+
+// Settle what the framing thread took off the queue since the last call and
+// wake anyone waiting for room. Called by the framing thread with
+// buffer_mutex held.
+void sender_release_queue(Sender* sender) {
+    if (sender->unqueued_cmds == 0 && sender->unqueued_bytes == 0) {
+        return;
+    }
+    sender->queued_cmds -= sender->unqueued_cmds;
+    sender->queued_bytes -= sender->unqueued_bytes;
+    sender->unqueued_cmds = 0;
+    sender->unqueued_bytes = 0;
+    pthread_cond_broadcast(&sender->space_cv);
+}
+
+// Frames not yet acked by their receiver, including framed ones waiting for
+// the window. Caller holds buffer_mutex.
+int sender_in_flight(Sender* sender) {
+    int frames = 0;
+    for (int dst_id = 0; dst_id < MAX_DESTS; dst_id++) {
+        frames += seq_bitmap_count(&sender->unacked[dst_id]) +
+                  ring_count(&sender->framed[dst_id]);
+    }
+    return frames;
+}
+
+// Whether every accepted command has been framed, sent and acked. Caller holds
+// buffer_mutex.
+bool sender_drained(Sender* sender) {
+    if (sender->input_cmdlist_head != NULL || sender->framing) {
+        return false;
+    }
+    for (int dst_id = 0; dst_id < MAX_DESTS; dst_id++) {
+        if (sender_has_pending(sender, dst_id)) {
+            return false;
+        }
+    }
+    return sender_in_flight(sender) == 0;
+}
+
+// Stop accepting commands; the threads keep running until everything that was
+// accepted is acked
+void sender_drain(Sender* sender) {
+    pthread_mutex_lock(&sender->buffer_mutex);
+    sender->draining = true;
+    pthread_cond_broadcast(&sender->space_cv);
+    pthread_mutex_unlock(&sender->buffer_mutex);
+}
+
+// Make run_sender and run_framer return at their next wakeup
+void sender_stop(Sender* sender) {
+    pthread_mutex_lock(&sender->buffer_mutex);
+    sender->stop = true;
+    pthread_cond_broadcast(&sender->space_cv);
+    pthread_cond_signal(&sender->buffer_cv);
+    pthread_cond_signal(&sender->framer_cv);
+    pthread_mutex_unlock(&sender->buffer_mutex);
+}
 
-            // Copy data
-            for (int i = 0; i < outgoing_frame->length; i++) {
-                outgoing_frame->data[i] = outgoing_cmd->message[i + idx];
+// Once the sender and framer threads are gone: report every message that
+// never completed as not acked, and free the commands that were not framed
+void sender_cancel_pending(Sender* sender) {
+    pthread_mutex_lock(&sender->buffer_mutex);
+    handle_input_cmds(sender);
+    for (int dst_id = 0; dst_id < MAX_DESTS; dst_id++) {
+        while (sender->done[dst_id] != NULL) {
+            LLnode* node = ll_pop_node(&sender->done[dst_id]);
+            struct Send_done_t* done = node->value;
+            if (sender->on_sent != NULL) {
+                sender->on_sent(sender, dst_id, done->user, false,
+                                sender->on_sent_ctx);
+            }
+            free(done);
+            free(node);
+        }
+        for (int p = 0; p < NUM_PRIORITIES; p++) {
+            Cmd* cmd = sender->current_cmd[dst_id][p];
+            sender->current_cmd[dst_id][p] = NULL;
+            while (cmd != NULL || sender->cmd_queue[dst_id][p] != NULL) {
+                if (cmd == NULL) {
+                    LLnode* node = ll_pop_node(&sender->cmd_queue[dst_id][p]);
+                    cmd = node->value;
+                    free(node);
+                }
+                if (sender->on_sent != NULL) {
+                    sender->on_sent(sender, dst_id, cmd->user, false,
+                                    sender->on_sent_ctx);
+                }
+                cmd_free(cmd);
+                cmd = NULL;
             }
+        }
+    }
+    pthread_mutex_unlock(&sender->buffer_mutex);
+}
+
+// Whether the framer has work it can do right now
+bool framer_ready(Sender* sender) {
+    if (sender->input_cmdlist_head != NULL) {
+        return true;
+    }
+    for (int dst_id = 0; dst_id < MAX_DESTS; dst_id++) {
+        if (sender_has_pending(sender, dst_id) && frame_room(sender, dst_id)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Frames per second dst_id's bucket refills at
+static double pace_rate(Sender* sender, uint8_t dst_id) {
+    if (glb_sysconfig.pace_rate > 0) {
+        return glb_sysconfig.pace_rate;
+    }
+    return PACE_GAIN * sender->cwnd[dst_id] * 1000000 / sender->srtt[dst_id];
+}
+
+// Tokens dst_id's bucket holds at now, up to PACE_BURST
+static double pace_refill(Sender* sender, uint8_t dst_id,
+                          struct timeval* now) {
+    long elapsed = timeval_usecdiff(&sender->pace_stamp[dst_id], now);
+    if (elapsed > 0) {
+        sender->pace_tokens[dst_id] +=
+            pace_rate(sender, dst_id) * elapsed / 1000000;
+        if (sender->pace_tokens[dst_id] > PACE_BURST) {
+            sender->pace_tokens[dst_id] = PACE_BURST;
+        }
+        sender->pace_stamp[dst_id] = *now;
+    }
+    return sender->pace_tokens[dst_id];
+}
+
+// Whether dst_id may send a new frame at now. Always true without -pace.
+static bool pace_allows(Sender* sender, uint8_t dst_id, struct timeval* now) {
+    return glb_sysconfig.pace_rate == 0 || pace_refill(sender, dst_id, now) >= 1;
+}
 
-            // Append CRC
-            outgoing_frame->crc = compute_crc(outgoing_frame);
-
-            // append to frame or output buffer
-            if (outgoing_frame->seq_num <
-                sender->LAR[outgoing_frame->dst_id] + WINDOW_SIZE) {
-                ll_append_node(outgoing_frames_head_ptr,
-                               copy_frame(outgoing_frame));
-            } else {
-                Frame* copied_frame = copy_frame(outgoing_frame);
-                ll_append_node(&sender->frame_buffer[outgoing_cmd->dst_id],
-                               copied_frame);
+// Move deadline up to when the first destination that is only held back by
+// its bucket gets a token
+static void sender_pace_deadline(Sender* sender, struct timespec* deadline) {
+    if (glb_sysconfig.pace_rate == 0) {
+        return;
+    }
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    for (int dst_id = 0; dst_id < MAX_DESTS; dst_id++) {
+        Frame* frame = ring_peek(&sender->framed[dst_id]);
+        if (frame == NULL ||
+            !within_send_window(sender, dst_id, frame->seq_num)) {
+            continue;
+        }
+        double missing = 1 - pace_refill(sender, dst_id, &now);
+        long usec = 0;
+        if (missing > 0) {
+            usec = (long) (missing * 1000000 / pace_rate(sender, dst_id)) + 1;
+        }
+        struct timespec when = {now.tv_sec + (now.tv_usec + usec) / 1000000,
+                                (now.tv_usec + usec) % 1000000 * 1000};
+        if (when.tv_sec < deadline->tv_sec ||
+            (when.tv_sec == deadline->tv_sec &&
+             when.tv_nsec < deadline->tv_nsec)) {
+            *deadline = when;
+        }
+    }
+}
+
+// Whether a framed frame is waiting for a destination with room in its window
+// and, with -pace, a token in its bucket
+bool transmit_ready(Sender* sender) {
+    struct timeval now;
+    if (glb_sysconfig.pace_rate != 0) {
+        gettimeofday(&now, NULL);
+    }
+    for (int dst_id = 0; dst_id < MAX_DESTS; dst_id++) {
+        Frame* frame = ring_peek(&sender->framed[dst_id]);
+        if (frame != NULL &&
+            within_send_window(sender, dst_id, frame->seq_num) &&
+            pace_allows(sender, dst_id, &now)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether run_sender has work without waiting. Caller holds buffer_mutex.
+static bool sender_ready(void* input_sender) {
+    Sender* sender = (Sender*) input_sender;
+    return sender->stop || sender->input_framelist_head != NULL ||
+           (!glb_sysconfig.pipelined && sender->input_cmdlist_head != NULL) ||
+           transmit_ready(sender);
+}
+
+static void unlock_buffer_mutex(void* mutex) {
+    pthread_mutex_unlock((pthread_mutex_t*) mutex);
+}
+
+// Framing stage of a pipelined sender. Commands are cut into frames and
+// checksummed ahead of the window here, so run_sender only has to deal with
+// acks, timers and the channel.
+void* run_framer(void* input_sender) {
+    Sender* sender = (Sender*) input_sender;
+    char thread_name[TRACE_NAME_SIZE];
+    snprintf(thread_name, sizeof(thread_name), "framer %d", sender->send_id);
+    trace_thread_name(thread_name);
+    pin_thread(glb_senders_array_length + glb_receivers_array_length +
+               sender->send_id);
+
+    pthread_mutex_lock(&sender->buffer_mutex);
+    pthread_cleanup_push(unlock_buffer_mutex, &sender->buffer_mutex);
+    while (!sender->stop) {
+        handle_input_cmds(sender);
+        sender->framing = true;
+        pthread_mutex_unlock(&sender->buffer_mutex);
+
+        bool framed = frame_ahead(sender);
+
+        pthread_mutex_lock(&sender->buffer_mutex);
+        sender->framing = false;
+        sender_release_queue(sender);
+        if (framed) {
+            pthread_cond_signal(&sender->buffer_cv);
+        }
+        // The transmit stage signals framer_cv once it frees ring slots
+        if (!framer_ready(sender) && !sender->stop) {
+            pthread_cond_wait(&sender->framer_cv, &sender->buffer_mutex);
+        }
+    }
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+// Duplex: carry the ack this host's receiver owes dst_id on a frame's first
+// transmission. Retransmissions go out unchanged, so the receiver's FEC copy
+// matches what the parity was computed over.
+static void piggyback_ack(Sender* sender, Frame* frame) {
+    uint8_t seq_num;
+    if (frame->dst_id < MAX_CLIENTS &&
+        receiver_take_ack(&glb_receivers_array[sender->send_id],
+                          frame->dst_id, &seq_num)) {
+        frame->flags |= FRAME_ACK;
+        frame->window = seq_num;
+        frame_seal(frame);
+    }
+}
+
+// Deficit round robin across destinations: every destination with framed data
+// and room in its window earns SCHED_QUANTUM bytes per round and spends them on
+// frames, so a bulk transfer to one receiver cannot starve the others. Sent
+// frames move into their tx_slot and are appended to outgoing, which holds
+// outgoing_count of at most MAX_OUTGOING frames, and the new count is
+// returned. Without acks, frames count as acked once sent and belong to
+// outgoing.
+int schedule_frames(Sender* sender, Frame** outgoing, int outgoing_count) {
+    bool acks = arq_policy()->acks;
+    bool progress = true;
+    struct timeval now;
+    if (glb_sysconfig.pace_rate != 0) {
+        gettimeofday(&now, NULL);
+    }
+    while (progress && outgoing_count < MAX_OUTGOING) {
+        progress = false;
+        for (int n = 0; n < MAX_DESTS && outgoing_count < MAX_OUTGOING;
+             n++) {
+            uint8_t dst_id = (sender->rr_next + n) % MAX_DESTS;
+            Frame_ring* ring = &sender->framed[dst_id];
+            Frame* next_frame = ring_peek(ring);
+            if (next_frame == NULL) {
+                sender->deficit[dst_id] = 0;
+                continue;
+            }
+            if (!within_send_window(sender, dst_id, next_frame->seq_num) ||
+                !pace_allows(sender, dst_id, &now)) {
+                continue;
             }
 
-            sender->LFS[outgoing_cmd->src_id] = seq_num;
-            seq_num = next_seq(seq_num);
-            free(outgoing_frame);
+            sender->deficit[dst_id] += SCHED_QUANTUM;
+            while (next_frame != NULL && outgoing_count < MAX_OUTGOING &&
+                   within_send_window(sender, dst_id, next_frame->seq_num) &&
+                   next_frame->length <= sender->deficit[dst_id] &&
+                   pace_allows(sender, dst_id, &now)) {
+                uint8_t seq_num = next_frame->seq_num;
+                sender->deficit[dst_id] -= next_frame->length;
+                if (glb_sysconfig.pace_rate != 0) {
+                    sender->pace_tokens[dst_id] -= 1;
+                }
+                sender->LFS[dst_id] = seq_num;
+                trace_event(TRACE_FRAME_SENT, sender->send_id, dst_id,
+                            seq_num, 0);
+                if (acks) {
+                    seq_bitmap_set(&sender->unacked[dst_id], seq_num);
+                    Tx_slot* slot = sender_tx_slot(sender, dst_id, seq_num);
+                    assert(slot->frame == NULL);
+                    slot->frame = ring_pop(ring);
+                    if (glb_sysconfig.duplex) {
+                        piggyback_ack(sender, slot->frame);
+                    }
+                    slot->pending =
+                        dst_id == GROUP_DST ? sender->group_members : 0;
+                    slot->sends = 0;
+                    slot->sacked = false;
+                    outgoing[outgoing_count++] = slot->frame;
+                } else {
+                    sender_complete(sender, dst_id, sender->LAR[dst_id],
+                                    seq_num);
+                    sender->LAR[dst_id] = seq_num;
+                    outgoing[outgoing_count++] = ring_pop(ring);
+                }
+                next_frame = ring_peek(ring);
+                progress = true;
+            }
+            if (next_frame == NULL) {
+                sender->deficit[dst_id] = 0;
+            }
         }
+    }
+    sender->rr_next = (sender->rr_next + 1) % MAX_DESTS;
+    return outgoing_count;
+}
 
-        free(outgoing_cmd->message);
-        free(outgoing_cmd);
+// Resend a group frame only to the members that have not acked it, each as a
+// copy addressed to that receiver. Returns the new outgoing count.
+int sender_group_copies(Sender* sender, Tx_slot* expired, Frame** outgoing,
+                        int outgoing_count) {
+    for (int member = 0; member < MAX_CLIENTS; member++) {
+        if (!(expired->pending & (1u << member))) {
+            continue;
+        }
+        Frame* copy = copy_frame(expired->frame);
+        copy->dst_id = member;
+        frame_seal(copy);
+        trace_event(TRACE_FRAME_RETX, sender->send_id, member, copy->seq_num,
+                    1);
+        outgoing[outgoing_count++] = copy;
     }
+    return outgoing_count;
 }
 
-void handle_timedout_frames(Sender* sender, LLnode** outgoing_frames_head_ptr) {
-    // TODO: Handle timeout by resending the appropriate message
-    LLnode* expired_frame_node = ll_pop_node(&sender->timeout);
-    Timed_frame* expired_t_frame = expired_frame_node->value;
-    ll_append_node(outgoing_frames_head_ptr,
-                   copy_frame(&expired_t_frame->frame));
-    ll_destroy_node(expired_frame_node);
+// Back off and let the reliability policy pick what to resend for an expired
+// slot. Resent frames stay in their slots and the send loop restarts their
+// timers. Returns the new outgoing count like schedule_frames.
+int handle_timedout_frames(Sender* sender, Tx_slot* expired, Frame** outgoing,
+                           int outgoing_count) {
+    uint8_t dst_id = expired->frame->dst_id;
+    uint8_t seq_num = expired->frame->seq_num;
+
+    // The receiver has it and only waits for an earlier frame: nothing was
+    // lost, so just wait another timeout for the cumulative ack
+    if (expired->sacked) {
+        gettimeofday(&expired->timeout, NULL);
+        expired->timeout.tv_usec += RETX_TIMEOUT_USEC;
+        expired->timeout.tv_sec += expired->timeout.tv_usec / 1000000;
+        expired->timeout.tv_usec %= 1000000;
+        return outgoing_count;
+    }
+
+    if (glb_sysconfig.link_count > 1) {
+        link_observe(sender, expired, true, false);
+    }
+
+    // Multiplicative decrease, once per window: frames sent before the last
+    // reduction do not shrink it again
+    uint8_t recover = sender->cwnd_recover[dst_id];
+    if (!within_window(recover, sender->LAR[dst_id]) ||
+        seq_distance(sender->LAR[dst_id], seq_num) >
+            seq_distance(sender->LAR[dst_id], recover)) {
+        sender->cwnd[dst_id] /= 2;
+        if (sender->cwnd[dst_id] < 1) {
+            sender->cwnd[dst_id] = 1;
+        }
+        sender->cwnd_recover[dst_id] = sender->LFS[dst_id];
+    }
+
+    return arq_policy()->retransmit(sender, expired, outgoing,
+                                    outgoing_count);
 }
 
 void* run_sender(void* input_sender) {
@@ -166,10 +1109,16 @@ void* run_sender(void* input_sender) {
     const int WAIT_SEC_TIME = 0;
     const long WAIT_USEC_TIME = 100000;
     Sender* sender = (Sender*) input_sender;
-    LLnode** outgoing_frames_head;
+    Frame* outgoing[MAX_OUTGOING];
+    int outgoing_count;
+    LLnode* parity_frames_head = NULL;
+    Tx_slot* expiring_slot;
     struct timeval* expiring_timeval;
     long sleep_usec_time, sleep_sec_time;
-    outgoing_frames_head = NULL;
+    char thread_name[TRACE_NAME_SIZE];
+    snprintf(thread_name, sizeof(thread_name), "sender %d", sender->send_id);
+    trace_thread_name(thread_name);
+    pin_thread(sender->send_id);
 
     while (1) {
 
@@ -183,7 +1132,9 @@ void* run_sender(void* input_sender) {
         time_spec.tv_nsec = curr_timeval.tv_usec * 1000;
 
         // Check for the next event we should handle
-        expiring_timeval = sender_get_next_expiring_timeval(sender);
+        expiring_slot = sender_get_next_expiring_slot(sender);
+        expiring_timeval =
+            expiring_slot != NULL ? &expiring_slot->timeout : NULL;
 
         // Perform full on timeout
         if (expiring_timeval == NULL) {
@@ -215,55 +1166,96 @@ void* run_sender(void* input_sender) {
         //      CAN/WILL access these structures
         //*****************************************************************************************
         pthread_mutex_lock(&sender->buffer_mutex);
+        if (sender->stop) {
+            pthread_mutex_unlock(&sender->buffer_mutex);
+            break;
+        }
 
-        // Check whether anything has arrived
-        int input_cmd_length = ll_get_length(sender->input_cmdlist_head);
+        // Check whether anything has arrived. Commands belong to the framer
+        // thread when the sender is pipelined.
+        int input_cmd_length = glb_sysconfig.pipelined
+                                   ? 0
+                                   : ll_get_length(sender->input_cmdlist_head);
         int inframe_queue_length = ll_get_length(sender->input_framelist_head);
 
         // Nothing (cmd nor incoming frame) has arrived, so do a timed wait on
         // the sender's condition variable (releases lock) A signal on the
         // condition variable will wakeup the thread and reaquire the lock
-        if (input_cmd_length == 0 && inframe_queue_length == 0) {
-            pthread_cond_timedwait(&sender->buffer_cv, &sender->buffer_mutex,
-                                   &time_spec);
+        if (input_cmd_length == 0 && inframe_queue_length == 0 &&
+            !transmit_ready(sender)) {
+            sender_pace_deadline(sender, &time_spec);
+            endpoint_wait(&sender->buffer_cv, &sender->buffer_mutex,
+                          &time_spec, sender_ready, sender);
+        }
+
+        if (!glb_sysconfig.pipelined) {
+            handle_input_cmds(sender);
+            frame_ahead(sender);
+            sender_release_queue(sender);
         }
 
-        handle_input_cmds(sender, &outgoing_frames_head);
+        handle_incoming_acks(sender);
+        outgoing_count = 0;
 
-        handle_incoming_acks(sender, &outgoing_frames_head);
+        // Handle timeout, unless the ack just freed the slot
+        if (expiring_slot != NULL && expiring_slot->frame != NULL &&
+            timeval_usecdiff(&curr_timeval, expiring_timeval) <= 0) {
+            outgoing_count = handle_timedout_frames(sender, expiring_slot,
+                                                    outgoing, outgoing_count);
+        }
 
-        // Handle timeout
-        if (expiring_timeval != NULL) {
-            long time_diff_sec =
-                timeval_usecdiff(&curr_timeval, expiring_timeval);
-            if (time_diff_sec <= 0 &&
-                ll_get_length(outgoing_frames_head) == 0) {
-                handle_timedout_frames(sender, &outgoing_frames_head);
-            }
+        outgoing_count = schedule_frames(sender, outgoing, outgoing_count);
+        if (glb_sysconfig.pipelined && outgoing_count > 0) {
+            pthread_cond_signal(&sender->framer_cv);
         }
 
         pthread_mutex_unlock(&sender->buffer_mutex);
 
-        // Send out all the frames
-        int ll_outgoing_frame_length = ll_get_length(outgoing_frames_head);
-        while (ll_outgoing_frame_length > 0) {
-            LLnode* ll_outframe_node = ll_pop_node(&outgoing_frames_head);
-            Timed_frame* t_frame = malloc(sizeof(Timed_frame));
-            Frame* frame = ll_outframe_node->value;
-            t_frame->timeout = curr_timeval;
-            t_frame->timeout.tv_sec =
-                (t_frame->timeout.tv_usec + 90000) / 1000000 +
-                t_frame->timeout.tv_sec;
-            t_frame->timeout.tv_usec =
-                (t_frame->timeout.tv_usec + 90000) % 1000000;
-            t_frame->frame = *frame;
-            ll_append_node(&sender->timeout, t_frame);
-
-            send_msg_to_receivers(convert_frame_to_char(frame));
-
-            ll_destroy_node(ll_outframe_node);
-
-            ll_outgoing_frame_length = ll_get_length(outgoing_frames_head);
+        // Send out all the frames and (re)start their timers. Slots are only
+        // freed by acks, which this thread handles, so the frames stay put.
+        struct timeval expires = curr_timeval;
+        expires.tv_sec += (expires.tv_usec + RETX_TIMEOUT_USEC) / 1000000;
+        expires.tv_usec = (expires.tv_usec + RETX_TIMEOUT_USEC) % 1000000;
+        for (int i = 0; i < outgoing_count; i++) {
+            Frame* frame = outgoing[i];
+            // Group retransmissions are per-member copies of a slot's frame
+            bool copy = (frame->flags & FRAME_GROUP) &&
+                        frame->dst_id != GROUP_DST;
+            int link = sender_pick_link(sender);
+            send_msg_on_link(frame_encode(frame), link);
+
+            if (fec_enabled() && !copy) {
+                fec_encode_frame(sender, frame, &parity_frames_head);
+            }
+
+            if (arq_policy()->acks) {
+                uint8_t dst_id = copy ? GROUP_DST : frame->dst_id;
+                Tx_slot* slot = sender_tx_slot(sender, dst_id, frame->seq_num);
+                slot->timeout = expires;
+                slot->link = link;
+                if (slot->sends < UINT8_MAX) {
+                    slot->sends++;
+                }
+            }
+            if (!arq_policy()->acks || copy) {
+                free(frame);
+            }
+        }
+
+        // Parity frames are fire and forget, they never take a tx_slot
+        if (fec_enabled()) {
+            for (int i = 0; i < MAX_DESTS; i++) {
+                if (ring_peek(&sender->framed[i]) == NULL) {
+                    fec_flush(sender, i, &parity_frames_head);
+                }
+            }
+            while (parity_frames_head != NULL) {
+                LLnode* ll_parity_node = ll_pop_node(&parity_frames_head);
+                send_msg_on_link(frame_encode(ll_parity_node->value),
+                                 sender_pick_link(sender));
+                free(ll_parity_node->value);
+                free(ll_parity_node);
+            }
         }
     }
     pthread_exit(NULL);
@@ -17,6 +17,45 @@
 #include <unistd.h>
 
 void init_sender(Sender*, int);
+void destroy_sender(Sender* sender);
 void* run_sender(void*);
+void* run_framer(void*);
+int send_window(Sender* sender, uint8_t dst_id);
+bool within_send_window(Sender* sender, uint8_t dst_id, uint8_t seq_num);
+void handle_incoming_acks(Sender* sender);
+int sender_send(Sender* sender, uint16_t dst_id, const char* buf, size_t len);
+void cmd_free(Cmd* cmd);
+int sender_send_mapped(Sender* sender, uint16_t dst_id, uint8_t stream_id,
+                       char* header, size_t header_len, char* mapping,
+                       size_t len, uint8_t priority);
+int sender_send_prio(Sender* sender, uint16_t dst_id, const char* buf,
+                     size_t len, uint8_t priority);
+int sender_send_group(Sender* sender, uint8_t stream_id, const char* buf,
+                      size_t len, uint8_t priority);
+int sender_send_stream(Sender* sender, uint16_t dst_id, uint8_t stream_id,
+                       const char* buf, size_t len, uint8_t priority);
+int sender_submit(Sender* sender, uint16_t dst_id, uint8_t stream_id,
+                  const char* buf, size_t len, uint8_t priority, void* user);
+void sender_set_callback(Sender* sender, Send_callback on_sent, void* ctx);
+void sender_cancel_pending(Sender* sender);
+int sender_in_flight(Sender* sender);
+bool sender_drained(Sender* sender);
+void sender_drain(Sender* sender);
+void sender_stop(Sender* sender);
+bool sender_has_pending(Sender* sender, uint8_t dst_id);
+bool frame_ahead(Sender* sender);
+void sender_release_queue(Sender* sender);
+// Frames run_sender hands to the channel per pass: every window, plus one
+// window of Go-Back-N retransmissions or one copy per group member
+#define MAX_OUTGOING (MAX_DESTS * WINDOW_SIZE + WINDOW_SIZE + MAX_CLIENTS)
+
+int schedule_frames(Sender* sender, Frame** outgoing, int outgoing_count);
+Tx_slot* sender_tx_slot(Sender* sender, uint8_t dst_id, uint8_t seq_num);
+int sender_group_copies(Sender* sender, Tx_slot* expired, Frame** outgoing,
+                        int outgoing_count);
+Tx_slot* sender_get_next_expiring_slot(Sender* sender);
+int sender_pick_link(Sender* sender);
+int handle_timedout_frames(Sender* sender, Tx_slot* expired, Frame** outgoing,
+                           int outgoing_count);
 
 #endif
@@ -0,0 +1,175 @@
+#include "simd.h"
+#include <stddef.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// The header filter only looks at the first four bytes of a frame
+static bool frame_header_ok(const Frame* frame, uint8_t dst_id,
+                            uint8_t max_src) {
+    return (frame->dst_id == dst_id || frame->dst_id == GROUP_DST) &&
+           frame->src_id < max_src &&
+           frame->length <= FRAME_PAYLOAD_SIZE;
+}
+
+static bool frame_crc_matches(const Frame* frame, uint32_t crc) {
+    return frame->crc[0] == (uint8_t) (crc >> 24) &&
+           frame->crc[1] == (uint8_t) (crc >> 16) &&
+           frame->crc[2] == (uint8_t) (crc >> 8) &&
+           frame->crc[3] == (uint8_t) crc;
+}
+
+#if defined(__AVX2__)
+
+static uint32_t load_word(const Frame* frame, int word) {
+    uint32_t value;
+    memcpy(&value, (const char*) frame + word * 4, sizeof(value));
+    return value;
+}
+
+// One frame per 32-bit lane. Every step loads the next four bytes of all
+// eight frames, then runs the table-driven CRC a byte at a time with a
+// gather into the lookup table. The first word doubles as the header.
+static unsigned validate_avx2(Frame* const* f, int count, uint8_t dst_id,
+                              uint8_t max_src) {
+    const int* table = (const int*) crc_table();
+    const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+    __m256i crc = _mm256_setzero_si256();
+    __m256i header = _mm256_setzero_si256();
+
+    for (int word = 0; word < (int) offsetof(Frame, crc) / 4; word++) {
+        __m256i v = _mm256_set_epi32(
+            load_word(f[7], word), load_word(f[6], word),
+            load_word(f[5], word), load_word(f[4], word),
+            load_word(f[3], word), load_word(f[2], word),
+            load_word(f[1], word), load_word(f[0], word));
+        if (word == 0) {
+            header = v;
+        }
+        for (int k = 0; k < 4; k++) {
+            __m256i b = _mm256_and_si256(_mm256_srli_epi32(v, 8 * k),
+                                         byte_mask);
+            __m256i idx = _mm256_xor_si256(_mm256_srli_epi32(crc, 24), b);
+            crc = _mm256_xor_si256(_mm256_slli_epi32(crc, 8),
+                                   _mm256_i32gather_epi32(table, idx, 4));
+        }
+    }
+
+    // The stored crc is big-endian, so byte swap before comparing
+    const __m256i bswap = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    int crc_word = offsetof(Frame, crc) / 4;
+    __m256i stored = _mm256_set_epi32(
+        load_word(f[7], crc_word), load_word(f[6], crc_word),
+        load_word(f[5], crc_word), load_word(f[4], crc_word),
+        load_word(f[3], crc_word), load_word(f[2], crc_word),
+        load_word(f[1], crc_word), load_word(f[0], crc_word));
+    __m256i ok = _mm256_cmpeq_epi32(_mm256_shuffle_epi8(crc, bswap), stored);
+
+    // src_id, dst_id and length are bytes 0, 1 and 2 of the header word
+    __m256i src = _mm256_and_si256(header, byte_mask);
+    __m256i dst = _mm256_and_si256(_mm256_srli_epi32(header, 8), byte_mask);
+    __m256i len = _mm256_and_si256(_mm256_srli_epi32(header, 16), byte_mask);
+    __m256i dst_ok = _mm256_or_si256(
+        _mm256_cmpeq_epi32(dst, _mm256_set1_epi32(dst_id)),
+        _mm256_cmpeq_epi32(dst, _mm256_set1_epi32(GROUP_DST)));
+    ok = _mm256_and_si256(ok, dst_ok);
+    ok = _mm256_and_si256(ok,
+                          _mm256_cmpgt_epi32(_mm256_set1_epi32(max_src), src));
+    ok = _mm256_andnot_si256(
+        _mm256_cmpgt_epi32(len, _mm256_set1_epi32(FRAME_PAYLOAD_SIZE)), ok);
+
+    unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(ok));
+    return mask & ((1u << count) - 1);
+}
+
+#endif
+
+// Interleaves the CRC of every frame in the batch so the independent
+// lookups overlap; this is the path used without AVX2 gathers.
+static unsigned validate_scalar(Frame* const* f, int count, uint8_t dst_id,
+                                uint8_t max_src) {
+    const uint32_t* table = crc_table();
+    uint32_t crc[FRAME_BATCH_SIZE] = {0};
+
+    for (size_t i = 0; i < offsetof(Frame, crc); i++) {
+        for (int l = 0; l < count; l++) {
+            uint8_t b = ((const uint8_t*) f[l])[i];
+            crc[l] = (crc[l] << 8) ^ table[(crc[l] >> 24) ^ b];
+        }
+    }
+
+    unsigned mask = 0;
+    for (int l = 0; l < count; l++) {
+        if (frame_header_ok(f[l], dst_id, max_src) &&
+            frame_crc_matches(f[l], crc[l])) {
+            mask |= 1u << l;
+        }
+    }
+    return mask;
+}
+
+unsigned frame_validate_batch(Frame* const* frames, int count, uint8_t dst_id,
+                              uint8_t max_src) {
+    if (count <= 0) {
+        return 0;
+    }
+#if defined(__AVX2__)
+    if (count > 1) {
+        // Pad short batches by repeating the first frame
+        Frame* lanes[FRAME_BATCH_SIZE];
+        for (int l = 0; l < FRAME_BATCH_SIZE; l++) {
+            lanes[l] = frames[l < count ? l : 0];
+        }
+        return validate_avx2(lanes, count, dst_id, max_src);
+    }
+#endif
+    return validate_scalar(frames, count, dst_id, max_src);
+}
+
+void frame_xor_mask(char* buf, const uint8_t* mask) {
+#if defined(__AVX2__)
+    for (int i = 0; i < MAX_FRAME_SIZE; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (buf + i));
+        __m256i m = _mm256_loadu_si256((const __m256i*) (mask + i));
+        _mm256_storeu_si256((__m256i*) (buf + i), _mm256_xor_si256(v, m));
+    }
+#elif defined(__SSE2__)
+    for (int i = 0; i < MAX_FRAME_SIZE; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (buf + i));
+        __m128i m = _mm_loadu_si128((const __m128i*) (mask + i));
+        _mm_storeu_si128((__m128i*) (buf + i), _mm_xor_si128(v, m));
+    }
+#elif defined(__ARM_NEON)
+    for (int i = 0; i < MAX_FRAME_SIZE; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*) buf + i);
+        vst1q_u8((uint8_t*) buf + i, veorq_u8(v, vld1q_u8(mask + i)));
+    }
+#else
+    for (int i = 0; i < MAX_FRAME_SIZE; i += 8) {
+        uint64_t v, m;
+        memcpy(&v, buf + i, sizeof(v));
+        memcpy(&m, mask + i, sizeof(m));
+        v ^= m;
+        memcpy(buf + i, &v, sizeof(v));
+    }
+#endif
+}
+
+const char* simd_kernel_name() {
+#if defined(__AVX2__)
+    return "avx2";
+#elif defined(__SSE2__)
+    return "sse2";
+#elif defined(__ARM_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
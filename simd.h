@@ -0,0 +1,24 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include "common.h"
+#include "util.h"
+#include <stdint.h>
+
+// Frames validated together by frame_validate_batch. Eight 32-bit CRC lanes
+// fill one AVX2 register.
+#define FRAME_BATCH_SIZE 8
+
+// Returns a bitmask with bit i set when frames[i] is addressed to dst_id or
+// GROUP_DST, comes from a src_id below max_src, has a sane length, and carries a
+// matching crc. count must not exceed FRAME_BATCH_SIZE.
+unsigned frame_validate_batch(Frame* const* frames, int count, uint8_t dst_id,
+                              uint8_t max_src);
+
+// XOR a MAX_FRAME_SIZE byte mask into a frame buffer
+void frame_xor_mask(char* buf, const uint8_t* mask);
+
+// Name of the kernels compiled in, for the startup banner
+const char* simd_kernel_name();
+
+#endif
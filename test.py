@@ -1,5 +1,12 @@
 import os
-from subprocess import Popen, PIPE, call
+import random
+import re
+import tempfile
+import threading
+import time
+from subprocess import Popen, PIPE, TimeoutExpired, call
+
+import trace_tool
 
 # os.system("./tritontalk -r 1 -s 1")
 # os.system("msg 0 0 yeet")
@@ -12,6 +19,358 @@ def simple_test():
     # for i in range(10):
     #     p.stdin.write("msg 0 0 PACKET: " + str(i))
     print(p.communicate())
-simple_test()
 
+# Sequence numbers run 1..255 and then wrap, so a few hundred one-frame
+# messages cross the boundary at least once. Every message has to show up
+# exactly once and in order, with and without loss. check, if given, also
+# has to accept the run's stderr.
+def wraparound_test(extra="", count=600, timeout=120, check=None,
+                    label=None):
+    p = Popen(cmd + " " + extra, stdin=PIPE, stdout=PIPE, stderr=PIPE,
+              shell=True, encoding='utf8')
+    got = []
+    err = []
+    def reader():
+        for line in p.stdout:
+            if line.startswith("<RECV_0>:[W"):
+                got.append(int(line[len("<RECV_0>:[W"):-2]))
+                if len(got) == count:
+                    return
+    t = threading.Thread(target=reader, daemon=True)
+    t.start()
+    e = threading.Thread(target=lambda: err.extend(p.stderr), daemon=True)
+    e.start()
+    p.stdin.write("".join("msg 0 0 W%d\n" % i for i in range(count)))
+    p.stdin.flush()
+    t.join(timeout)
+    p.stdin.write("exit\n")
+    p.stdin.flush()
+    p.wait()
+    e.join()
+    ok = got == list(range(count))
+    note = ""
+    if ok and check is not None:
+        ok, note = check("".join(err))
+    print("wraparound %-16s %s (%d/%d)%s" % (label or extra or "lossless",
+                                            "ok" if ok else "FAILED",
+                                            len(got), count,
+                                            " " + note if note else ""))
+    return ok
+
+# Payloads are bytes, not strings: NULs, newlines and high bytes, sent with
+# xmsg as hex, have to come out of the receiver byte for byte
+def binary_test(extra="", count=50, timeout=60):
+    rng = random.Random(27)
+    payloads = [bytes([0, 10, 255, 128]) +
+                bytes(rng.randrange(256) for _ in range(rng.randrange(1, 150)))
+                for _ in range(count)]
+    p = Popen(cmd + " " + extra, stdin=PIPE, stdout=PIPE, stderr=PIPE,
+              shell=True)
+    script = "".join("xmsg 0 0 %s\n" % m.hex() for m in payloads)
+    try:
+        out, _ = p.communicate((script + "exit\n").encode(), timeout=timeout)
+    except TimeoutExpired:
+        p.kill()
+        out = b""
+    expected = b"".join(b"<RECV_0>:[" + m + b"]\n" for m in payloads)
+    ok = out == expected
+    print("binary     %-16s %s (%d bytes)" % (extra or "lossless",
+                                             "ok" if ok else "FAILED",
+                                             len(expected)))
+    return ok
+
+def trace_count(path, kind):
+    events, _, _ = trace_tool.load(path)
+    return sum(1 for e in events if trace_tool.TYPES.get(e[2]) == kind)
+
+# FEC has to actually rebuild frames, not just stay out of the way of ARQ
+def fec_test(extra="-d 0.2 -k 4 -m 1"):
+    path = os.path.join(tempfile.mkdtemp(), "fec.trace")
+    def recovered(err):
+        n = trace_count(path, "frame_recovered")
+        return n > 0, "%d recovered" % n
+    return wraparound_test(extra + " -t " + path, check=recovered,
+                           label=extra)
+
+# The drops and corruptions a link sees only depend on -seed. Without acks
+# the data link carries every frame exactly once and in order, so two runs
+# with the same seed have to impair the same frames and deliver the same
+# bytes, and a different seed has to change them.
+def impairments(path):
+    events, _, _ = trace_tool.load(path)
+    return [(trace_tool.TYPES.get(e[2]), e[3], e[4], e[5])
+            for e in sorted(events)
+            if trace_tool.TYPES.get(e[2]) in ("frame_dropped",
+                                              "frame_corrupted")]
+
+def seeded_run(seed, extra, count, timeout):
+    path = os.path.join(tempfile.mkdtemp(), "seed.trace")
+    p = Popen(cmd + " -mode dgram -seed %d -t %s %s" % (seed, path, extra),
+              stdin=PIPE, stdout=PIPE, stderr=PIPE, shell=True)
+    script = "".join("msg 0 0 R%d\n" % i for i in range(count)) + "exit\n"
+    try:
+        out, _ = p.communicate(script.encode(), timeout=timeout)
+    except TimeoutExpired:
+        p.kill()
+        return None
+    return impairments(path), out
+
+def seed_test(extra="-d 0.2 -c 0.1", seed=34, count=600, timeout=60):
+    first = seeded_run(seed, extra, count, timeout)
+    again = seeded_run(seed, extra, count, timeout)
+    other = seeded_run(seed + 1, extra, count, timeout)
+    ok = (first is not None and len(first[0]) > 0 and first == again and
+          other is not None and other[0] != first[0])
+    print("seed       %-16s %s (%d impairments)" % (extra,
+                                                   "ok" if ok else "FAILED",
+                                                   len(first[0]) if first
+                                                   else 0))
+    return ok
+
+# Input ending while frames are still in flight must not lose them: the
+# report has to show every message delivered. When nothing can get through,
+# the drain gives up after -drain seconds and says how much is missing.
+def drain_test(extra="-d 0.2 -drain 30", count=200, expect_all=True, timeout=60):
+    p = Popen(cmd + " " + extra, stdin=PIPE, stdout=PIPE, stderr=PIPE,
+              shell=True, encoding='utf8')
+    script = "".join("msg 0 0 D%d\n" % i for i in range(count)) + "exit\n"
+    try:
+        out, err = p.communicate(script, timeout=timeout)
+    except TimeoutExpired:
+        p.kill()
+        out = err = ""
+    m = re.search(r"Drained in ([0-9.]+)s: (\d+) of (\d+) messages delivered",
+                  err)
+    printed = out.count("<RECV_0>:[D")
+    if m is None:
+        ok = False
+    elif expect_all:
+        ok = int(m.group(2)) == int(m.group(3)) == printed == count
+    else:
+        # -drain is the upper bound the timeout path has to stop at
+        limit = float(extra.split("-drain ")[1].split()[0])
+        ok = (int(m.group(3)) == count and int(m.group(2)) == printed < count
+              and limit <= float(m.group(1)) < limit + 1)
+    print("drain      %-16s %s (%s)" % (extra, "ok" if ok else "FAILED",
+                                         m.group(0) if m else "no report"))
+    return ok
+
+# Checks of the feature specific lines in the exit report, for
+# wraparound_test's check
+def spin_used(err):
+    m = re.search(r"Spin: (\d+) wakeup\(s\) while polling", err)
+    return m is not None and int(m.group(1)) > 0, m.group(0) if m else ""
+
+def acks_piggybacked(err):
+    m = re.search(r"Acks: .* (\d+) piggybacked", err)
+    return m is not None and int(m.group(1)) > 0, m.group(0) if m else ""
 
+def links_used(err):
+    frames = [int(n) for n in re.findall(r"\[\d+\] (\d+) frames", err)]
+    return len(frames) > 1 and all(frames), "link frames %s" % frames
+
+# A fixed -pace rate holds the sender back: after the bucket's burst, count
+# frames cannot go out faster than count / rate seconds
+def pace_test(rate=500, count=300):
+    start = time.monotonic()
+    def paced(err):
+        elapsed = time.monotonic() - start
+        return elapsed >= (count - 2) / rate, "%.2fs" % elapsed
+    return wraparound_test("-pace %d" % rate, count=count, check=paced)
+
+# The C checks of the sequence and window helpers
+def unit_test():
+    ok = call("make -s unit_test && ./unit_test", shell=True) == 0
+    print("unit       %-16s %s" % ("unit_test", "ok" if ok else "FAILED"))
+    return ok
+
+# A host program of the library, linked statically and as a shared library,
+# running two rounds of init, submit, shutdown and destroy
+def lib_test():
+    ok = call("make -s lib_test lib_test_so && ./lib_test && ./lib_test_so",
+              shell=True) == 0
+    print("lib        %-16s %s" % ("lib_test", "ok" if ok else "FAILED"))
+    return ok
+
+# A high-priority message queued behind a backlog of bulk data has to be
+# framed as soon as the bulk message in progress ends, not after the backlog
+def priority_test(extra="-d 0.2", count=100, timeout=120):
+    p = Popen(cmd + " " + extra, stdin=PIPE, stdout=PIPE, stderr=PIPE,
+              shell=True, encoding='utf8')
+    got = []
+    done = threading.Event()
+    def reader():
+        for line in p.stdout:
+            if line.startswith("<RECV_0>:[B") or line == "<RECV_0>:[P]\n":
+                got.append(line[len("<RECV_0>:["):-2].split("-")[0])
+                if len(got) == count + 1:
+                    done.set()
+                    return
+    t = threading.Thread(target=reader, daemon=True)
+    t.start()
+    # Every bulk message spans several frames
+    p.stdin.write("".join("pmsg 0 0 2 B%d-%s\n" % (i, "x" * 200)
+                          for i in range(count)))
+    p.stdin.write("pmsg 0 0 0 P\n")
+    p.stdin.flush()
+    done.wait(timeout)
+    p.stdin.write("exit\n")
+    p.stdin.flush()
+    p.wait()
+    bulk = [m for m in got if m != "P"]
+    at = got.index("P") if "P" in got else -1
+    ok = bulk == ["B%d" % i for i in range(count)] and 0 <= at < count // 2
+    print("priority   %-16s %s (P at %d of %d)" % (extra or "lossless",
+                                                  "ok" if ok else "FAILED",
+                                                  at, len(got)))
+    return ok
+
+# A file has to arrive byte for byte in the receiver's directory. Output
+# paths that leave it are refused, and a file header sent as a plain message
+# is just printed.
+def file_test(extra="-d 0.2", size=30000, timeout=120):
+    work = tempfile.mkdtemp()
+    rng = random.Random(37)
+    data = bytes(rng.randrange(256) for _ in range(size))
+    src = os.path.join(work, "src.bin")
+    with open(src, "wb") as f:
+        f.write(data)
+    # The refused transfers carry the first bytes only
+    small = os.path.join(work, "small.bin")
+    with open(small, "wb") as f:
+        f.write(data[:100])
+    header = b"TTFILE1\0" + bytes(14)
+    script = ("file 0 0 %s out.bin\nfile 0 0 %s ../escape.bin\n"
+              "file 0 0 %s %s\nxmsg 0 0 %s\nexit\n" %
+              (src, small, small, os.path.join(work, "abs.bin"),
+               header.hex()))
+    p = Popen(os.path.abspath("tritontalk") + " -r 1 -s 1 -drain 60 " + extra,
+              stdin=PIPE, stdout=PIPE, stderr=PIPE, shell=True, cwd=work)
+    try:
+        out, err = p.communicate(script.encode(), timeout=timeout)
+    except TimeoutExpired:
+        p.kill()
+        out = err = b""
+    out_path = os.path.join(work, "out.bin")
+    got = open(out_path, "rb").read() if os.path.exists(out_path) else b""
+    ok = (got == data and b"out.bin %d bytes checksum ok" % size in out and
+          err.count(b"refusing") == 2 and
+          not os.path.exists(os.path.join(os.path.dirname(work),
+                                          "escape.bin")) and
+          not os.path.exists(os.path.join(work, "abs.bin")) and
+          b"<RECV_0>:[" + header + b"]\n" in out)
+    print("file       %-16s %s (%d/%d bytes)" % (extra or "lossless",
+                                                "ok" if ok else "FAILED",
+                                                len(got), size))
+    return ok
+
+# Messages on different streams may overtake each other, but every stream
+# has to come out complete and in its own order
+def streams_test(extra="", streams=3, count=300, timeout=120):
+    p = Popen(cmd + " " + extra, stdin=PIPE, stdout=PIPE, stderr=PIPE,
+              shell=True, encoding='utf8')
+    got = {s: [] for s in range(streams)}
+    done = threading.Event()
+    def reader():
+        total = 0
+        for line in p.stdout:
+            if line.startswith("<RECV_0>:[S"):
+                stream, idx = line[len("<RECV_0>:[S"):-2].split("-")
+                got[int(stream)].append(int(idx))
+                total += 1
+                if total == count:
+                    done.set()
+                    return
+    t = threading.Thread(target=reader, daemon=True)
+    t.start()
+    p.stdin.write("".join("smsg 0 0 %d S%d-%d\n" % (i % streams, i % streams, i)
+                          for i in range(count)))
+    p.stdin.flush()
+    done.wait(timeout)
+    p.stdin.write("exit\n")
+    p.stdin.flush()
+    p.wait()
+    ok = all(got[s] == list(range(s, count, streams)) for s in got)
+    print("streams    %-16s %s (%d/%d)" % (extra or "lossless",
+                                          "ok" if ok else "FAILED",
+                                          sum(len(v) for v in got.values()),
+                                          count))
+    return ok
+
+# A group message is framed once and has to reach every receiver, complete
+# and in order, even when each receiver loses different acks
+def group_test(extra="", receivers=3, count=200, timeout=120):
+    p = Popen(cmd + " -r %d " % receivers + extra, stdin=PIPE, stdout=PIPE,
+              stderr=PIPE, shell=True, encoding='utf8')
+    got = {r: [] for r in range(receivers)}
+    done = threading.Event()
+    def reader():
+        total = 0
+        for line in p.stdout:
+            if line.startswith("<RECV_") and ":[G" in line:
+                recv, body = line[len("<RECV_"):].split(">:[G")
+                got[int(recv)].append(int(body.split("-")[0]))
+                total += 1
+                if total == count * receivers:
+                    done.set()
+                    return
+    t = threading.Thread(target=reader, daemon=True)
+    t.start()
+    # Every third message spans several frames
+    p.stdin.write("".join("gmsg 0 G%d-%s\n" % (i, "x" * (120 if i % 3 else 0))
+                          for i in range(count)))
+    p.stdin.flush()
+    done.wait(timeout)
+    p.stdin.write("exit\n")
+    p.stdin.flush()
+    p.wait()
+    ok = all(got[r] == list(range(count)) for r in got)
+    print("group      %-16s %s (%d/%d)" % (extra or "lossless",
+                                          "ok" if ok else "FAILED",
+                                          sum(len(v) for v in got.values()),
+                                          count * receivers))
+    return ok
+
+# The scenario generator offers a fixed load and reports it per phase; every
+# message it sends has to be delivered, lossless or not
+def scenario_test(path="scenario.txt", senders=1, receivers=2, timeout=120):
+    p = Popen("./tritontalk -s %d -r %d -a %s" % (senders, receivers, path),
+              stdout=PIPE, stderr=PIPE, shell=True, encoding='utf8')
+    try:
+        _, err = p.communicate(timeout=timeout)
+    except TimeoutExpired:
+        p.kill()
+        err = ""
+    sent = delivered = 0
+    for m in re.finditer(r"Scenario phase \d+: (\d+) sent .* (\d+) delivered",
+                         err):
+        sent += int(m.group(1))
+        delivered += int(m.group(2))
+    ok = sent > 0 and sent == delivered
+    print("scenario   %-16s %s (%d/%d)" % ("%s -s %d" % (path, senders),
+                                          "ok" if ok else "FAILED",
+                                          delivered, sent))
+    return ok
+
+simple_test()
+results = [unit_test(), lib_test(), wraparound_test(), wraparound_test("-d 0.2"),
+           wraparound_test("-d 0.2 -c 0.1"), fec_test(),
+           binary_test(), binary_test("-d 0.2"),
+           priority_test(), priority_test("-d 0.2 -pipeline 0"),
+           file_test(), file_test("-d 0.2 -c 0.1"),
+           streams_test(), streams_test("-d 0.2"),
+           streams_test("-d 0.2 -k 4 -m 1"),
+           wraparound_test("-mode gbn -d 0.2"), streams_test("-mode gbn -d 0.2"),
+           wraparound_test("-mode dgram"), seed_test(),
+           group_test(), group_test("-d 0.2"), group_test("-d 0.2 -k 4 -m 1"),
+           wraparound_test("-qlen 4 -d 0.2"), group_test("-qbytes 200 -d 0.2"),
+           wraparound_test("-spin 100 -d 0.2", check=spin_used),
+           wraparound_test("-duplex -d 0.2", check=acks_piggybacked),
+           streams_test("-duplex -d 0.2"),
+           wraparound_test("-links 3 -d 0.1 -link 2 0.5 0",
+                           check=links_used),
+           drain_test(), drain_test("-d 1 -drain 0.5", expect_all=False),
+           scenario_test(), scenario_test(senders=2),
+           wraparound_test("-pace auto -d 0.2"), pace_test(),
+           wraparound_test("-d 0.1 -c 0.3")]
+exit(0 if all(results) else 1)
@@ -0,0 +1,226 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "trace.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Records per thread ring. A full ring drops new records rather than stall
+// the thread that is being traced.
+#define TRACE_RING_SIZE 8192
+#define TRACE_FLUSH_NSEC 10000000
+
+// Single producer (the owning thread), single consumer (the flusher)
+struct Trace_ring_t {
+    atomic_size_t head;
+    char pad[64 - sizeof(atomic_size_t)];
+    atomic_size_t tail;
+    uint32_t thread;
+    char name[TRACE_NAME_SIZE];
+    atomic_bool named;
+    bool name_written;
+    struct Trace_ring_t* next;
+    Trace_record records[TRACE_RING_SIZE];
+};
+typedef struct Trace_ring_t Trace_ring;
+
+atomic_bool trace_on = false;
+
+static FILE* trace_file;
+static pthread_t trace_flusher;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_cv = PTHREAD_COND_INITIALIZER;
+static bool trace_stopping;
+static bool trace_opened;
+static Trace_ring* trace_rings;
+static uint32_t trace_threads;
+static atomic_ullong trace_lost;
+static _Thread_local Trace_ring* my_ring;
+
+static uint64_t trace_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Raw cycle counter where there is one; the header and trailer pair it with
+// the monotonic clock so the tool can convert
+static uint64_t trace_tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return trace_now_ns();
+#endif
+}
+
+static void trace_write_clock() {
+    uint64_t clock[2] = {trace_tsc(), trace_now_ns()};
+    fwrite(clock, sizeof(clock), 1, trace_file);
+}
+
+static Trace_ring* trace_ring() {
+    if (my_ring == NULL) {
+        my_ring = calloc(1, sizeof(Trace_ring));
+        atomic_init(&my_ring->head, 0);
+        atomic_init(&my_ring->tail, 0);
+        atomic_init(&my_ring->named, false);
+        pthread_mutex_lock(&trace_mutex);
+        my_ring->thread = trace_threads++;
+        my_ring->next = trace_rings;
+        trace_rings = my_ring;
+        pthread_mutex_unlock(&trace_mutex);
+    }
+    return my_ring;
+}
+
+void trace_thread_name(const char* name) {
+    if (!atomic_load_explicit(&trace_on, memory_order_acquire)) {
+        return;
+    }
+    Trace_ring* ring = trace_ring();
+    strncpy(ring->name, name, TRACE_NAME_SIZE - 1);
+    atomic_store_explicit(&ring->named, true, memory_order_release);
+}
+
+void trace_record(uint8_t type, uint8_t src_id, uint8_t dst_id,
+                  uint8_t seq_num, uint32_t arg) {
+    Trace_ring* ring = trace_ring();
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&trace_lost, 1, memory_order_relaxed);
+        return;
+    }
+    Trace_record* record = &ring->records[tail % TRACE_RING_SIZE];
+    record->tsc = trace_tsc();
+    record->arg = arg;
+    record->type = type;
+    record->src_id = src_id;
+    record->dst_id = dst_id;
+    record->seq_num = seq_num;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+// Write out everything the rings hold. Only the flusher (or trace_close once
+// the flusher is gone) calls this.
+static void trace_drain() {
+    pthread_mutex_lock(&trace_mutex);
+    Trace_ring* rings = trace_rings;
+    pthread_mutex_unlock(&trace_mutex);
+
+    for (Trace_ring* ring = rings; ring != NULL; ring = ring->next) {
+        if (!ring->name_written &&
+            atomic_load_explicit(&ring->named, memory_order_acquire)) {
+            uint32_t block[2] = {ring->thread, TRACE_NAME_BLOCK};
+            fwrite(block, sizeof(block), 1, trace_file);
+            fwrite(ring->name, TRACE_NAME_SIZE, 1, trace_file);
+            ring->name_written = true;
+        }
+
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        while (head != tail) {
+            // Contiguous run up to the end of the ring
+            size_t start = head % TRACE_RING_SIZE;
+            size_t count = tail - head;
+            if (start + count > TRACE_RING_SIZE) {
+                count = TRACE_RING_SIZE - start;
+            }
+            uint32_t block[2] = {ring->thread, count};
+            fwrite(block, sizeof(block), 1, trace_file);
+            fwrite(&ring->records[start], sizeof(Trace_record), count,
+                   trace_file);
+            head += count;
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+    }
+}
+
+static void* run_trace_flusher(void* arg) {
+    (void) arg;
+    pthread_mutex_lock(&trace_mutex);
+    while (!trace_stopping) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += TRACE_FLUSH_NSEC;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&trace_cv, &trace_mutex, &ts);
+        pthread_mutex_unlock(&trace_mutex);
+        trace_drain();
+        pthread_mutex_lock(&trace_mutex);
+    }
+    pthread_mutex_unlock(&trace_mutex);
+    return NULL;
+}
+
+// One trace per process: trace_close frees the rings that threads still point
+// to through my_ring, so tracing cannot be turned on again after it
+int trace_open(const char* path) {
+    if (trace_opened) {
+        fprintf(stderr, "Trace already written, not opening %s\n", path);
+        return -1;
+    }
+    trace_file = fopen(path, "wb");
+    if (trace_file == NULL) {
+        fprintf(stderr, "Cannot open trace file %s\n", path);
+        return -1;
+    }
+    fwrite("TTTRACE1", 8, 1, trace_file);
+    trace_write_clock();
+    atomic_init(&trace_lost, 0);
+    trace_opened = true;
+    atomic_store_explicit(&trace_on, true, memory_order_release);
+    trace_thread_name("main");
+
+    int rc = pthread_create(&trace_flusher, NULL, run_trace_flusher, NULL);
+    if (rc) {
+        fprintf(stderr, "ERROR; return code from pthread_create() is %d\n", rc);
+        exit(-1);
+    }
+    return 0;
+}
+
+// Stop the flusher, write what is left and close the file. Threads that are
+// still running after this point must not trace.
+void trace_close() {
+    if (!atomic_load(&trace_on)) {
+        return;
+    }
+    pthread_mutex_lock(&trace_mutex);
+    trace_stopping = true;
+    pthread_cond_signal(&trace_cv);
+    pthread_mutex_unlock(&trace_mutex);
+    pthread_join(trace_flusher, NULL);
+    atomic_store_explicit(&trace_on, false, memory_order_release);
+    trace_drain();
+
+    uint32_t block[2] = {TRACE_END_THREAD, 0};
+    fwrite(block, sizeof(block), 1, trace_file);
+    trace_write_clock();
+    uint64_t lost = atomic_load(&trace_lost);
+    fwrite(&lost, sizeof(lost), 1, trace_file);
+    fclose(trace_file);
+    if (lost > 0) {
+        fprintf(stderr, "Trace: %llu records lost to full buffers\n",
+                (unsigned long long) lost);
+    }
+
+    pthread_mutex_lock(&trace_mutex);
+    while (trace_rings != NULL) {
+        Trace_ring* next = trace_rings->next;
+        free(trace_rings);
+        trace_rings = next;
+    }
+    pthread_mutex_unlock(&trace_mutex);
+    my_ring = NULL;
+}
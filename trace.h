@@ -0,0 +1,65 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Frame lifecycle tracing, enabled with -t <file>. Every thread appends
+// 16-byte records to its own ring, a flusher thread drains the rings to the
+// file in the background, and trace_tool.py turns the file into per-message
+// latency breakdowns and Chrome trace JSON.
+//
+// File layout (host byte order):
+//   header:  "TTTRACE1", uint64 tsc, uint64 monotonic ns
+//   blocks:  uint32 thread, uint32 count, count * Trace_record
+//            count == TRACE_NAME_BLOCK: 16 byte thread name instead
+//   trailer: uint32 TRACE_END_THREAD, uint32 0, uint64 tsc, uint64 ns,
+//            uint64 records lost to full rings
+enum Trace_type {
+    TRACE_MSG_QUEUED = 1,  // arg: msg id, seq: priority
+    TRACE_FRAME_CREATED,   // arg: msg id
+    TRACE_FRAME_SENT,      // first transmission
+    TRACE_FRAME_RETX,      // arg: 1 when it timed out
+    TRACE_FRAME_DROPPED,   // by the channel, arg: 1 for acks
+    TRACE_FRAME_CORRUPTED, // by the channel, arg: 1 for acks
+    TRACE_FRAME_RECEIVED,  // valid frame at the receiver, arg: parity
+    TRACE_FRAME_REJECTED,  // failed validation at the receiver
+    TRACE_FRAME_RECOVERED, // rebuilt from FEC parity
+    TRACE_FRAME_ACKED,     // seq: new LAR, arg: frames acked
+    TRACE_MSG_DELIVERED,   // seq: last frame of the message
+};
+
+struct Trace_record_t {
+    uint64_t tsc;
+    uint32_t arg;
+    uint8_t type;
+    uint8_t src_id;
+    uint8_t dst_id;
+    uint8_t seq_num;
+};
+typedef struct Trace_record_t Trace_record;
+_Static_assert(sizeof(Trace_record) == 16, "Trace records are 16 bytes");
+
+#define TRACE_NAME_BLOCK 0xFFFFFFFF
+#define TRACE_END_THREAD 0xFFFFFFFF
+#define TRACE_NAME_SIZE 16
+
+// Set by trace_open and cleared by trace_close, read by every traced thread
+extern atomic_bool trace_on;
+
+int trace_open(const char* path);
+void trace_close();
+void trace_thread_name(const char* name);
+void trace_record(uint8_t type, uint8_t src_id, uint8_t dst_id,
+                  uint8_t seq_num, uint32_t arg);
+
+// Costs one predictable branch when tracing is off
+static inline void trace_event(uint8_t type, uint8_t src_id, uint8_t dst_id,
+                               uint8_t seq_num, uint32_t arg) {
+    if (atomic_load_explicit(&trace_on, memory_order_acquire)) {
+        trace_record(type, src_id, dst_id, seq_num, arg);
+    }
+}
+
+#endif
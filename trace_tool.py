@@ -0,0 +1,195 @@
+import argparse
+import json
+import struct
+import sys
+
+# Reads a trace written by tritontalk -t <file> (see trace.h for the layout)
+# and prints a per-message latency breakdown, optionally writing Chrome trace
+# JSON that can be loaded in chrome://tracing or Perfetto.
+#
+#   python3 trace_tool.py trace.bin [--chrome trace.json] [--quiet]
+
+NAME_BLOCK = 0xFFFFFFFF
+END_THREAD = 0xFFFFFFFF
+RECORD = struct.Struct("=QIBBBB")
+BLOCK = struct.Struct("=II")
+CLOCK = struct.Struct("=QQ")
+
+TYPES = {
+    1: "msg_queued",
+    2: "frame_created",
+    3: "frame_sent",
+    4: "frame_retx",
+    5: "frame_dropped",
+    6: "frame_corrupted",
+    7: "frame_received",
+    8: "frame_rejected",
+    9: "frame_recovered",
+    10: "frame_acked",
+    11: "msg_delivered",
+}
+
+
+def percentile(values, p):
+    if not values:
+        return float("nan")
+    values = sorted(values)
+    idx = min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))
+    return values[idx]
+
+
+def load(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[:8] != b"TTTRACE1":
+        sys.exit("%s is not a tritontalk trace" % path)
+    start = CLOCK.unpack_from(data, 8)
+    pos = 8 + CLOCK.size
+    names = {}
+    records = []
+    end = None
+    lost = 0
+    while pos + BLOCK.size <= len(data):
+        thread, count = BLOCK.unpack_from(data, pos)
+        pos += BLOCK.size
+        if thread == END_THREAD:
+            end = CLOCK.unpack_from(data, pos)
+            lost = struct.unpack_from("=Q", data, pos + CLOCK.size)[0]
+            break
+        if count == NAME_BLOCK:
+            names[thread] = data[pos:pos + 16].split(b"\0")[0].decode()
+            pos += 16
+            continue
+        for _ in range(count):
+            tsc, arg, kind, src, dst, seq = RECORD.unpack_from(data, pos)
+            records.append((tsc, thread, kind, src, dst, seq, arg))
+            pos += RECORD.size
+    if end is None:
+        sys.exit("%s has no trailer, was tritontalk stopped early?" % path)
+    records.sort()
+
+    # Convert cycle counts to microseconds since the trace was opened
+    ticks = end[0] - start[0]
+    ns = end[1] - start[1]
+    scale = (ns / ticks if ticks else 1.0) / 1000.0
+    events = [((r[0] - start[0]) * scale,) + r[1:] for r in records]
+    return events, names, lost
+
+
+def messages(events):
+    # Frames are mapped back to the message they were cut from through the
+    # most recent frame_created with the same (src, dst, seq)
+    frame_msg = {}
+    msgs = {}
+
+    def msg(key):
+        return msgs.setdefault(key, {"frames": 0, "retx": 0, "drops": 0})
+
+    for ts, _, kind, src, dst, seq, arg in events:
+        name = TYPES.get(kind)
+        if name == "msg_queued":
+            msg((src, dst, arg))["queued"] = ts
+        elif name == "frame_created":
+            key = (src, dst, arg)
+            frame_msg[(src, dst, seq)] = key
+            m = msg(key)
+            m["frames"] += 1
+            m.setdefault("created", ts)
+        key = frame_msg.get((src, dst, seq))
+        if key is None:
+            continue
+        m = msg(key)
+        if name == "frame_sent":
+            m.setdefault("sent", ts)
+        elif name == "frame_retx":
+            m["retx"] += 1
+        elif name == "frame_dropped" and arg == 0:
+            m["drops"] += 1
+        elif name == "msg_delivered":
+            m.setdefault("delivered", ts)
+    return msgs
+
+
+def report(msgs, quiet):
+    rows = []
+    for key in sorted(msgs):
+        m = msgs[key]
+        if not all(k in m for k in ("queued", "created", "sent", "delivered")):
+            continue
+        row = (key, m["created"] - m["queued"], m["sent"] - m["created"],
+               m["delivered"] - m["sent"], m["delivered"] - m["queued"],
+               m["frames"], m["retx"], m["drops"])
+        rows.append(row)
+
+    header = "%-14s %10s %10s %10s %10s %6s %5s %5s" % (
+        "message", "queue us", "window us", "network us", "total us",
+        "frames", "retx", "drops")
+    if not quiet:
+        print(header)
+        for (src, dst, mid), q, w, n, t, frames, retx, drops in rows:
+            print("%-14s %10.0f %10.0f %10.0f %10.0f %6d %5d %5d" %
+                  ("%d->%d #%d" % (src, dst, mid), q, w, n, t, frames, retx,
+                   drops))
+        print()
+
+    print("%d of %d messages delivered" % (len(rows), len(msgs)))
+    print("%-10s %10s %10s %10s" % ("stage", "p50 us", "p90 us", "p99 us"))
+    for i, stage in enumerate(["queue", "window", "network", "total"]):
+        values = [r[1 + i] for r in rows]
+        print("%-10s %10.0f %10.0f %10.0f" %
+              (stage, percentile(values, 50), percentile(values, 90),
+               percentile(values, 99)))
+
+
+def chrome(events, names, msgs, path):
+    out = []
+    for thread, name in names.items():
+        out.append({"name": "thread_name", "ph": "M", "pid": 0,
+                    "tid": thread, "args": {"name": name}})
+    for ts, thread, kind, src, dst, seq, arg in events:
+        out.append({"name": TYPES.get(kind, str(kind)), "ph": "i", "s": "t",
+                    "ts": ts, "pid": 0, "tid": thread,
+                    "args": {"src": src, "dst": dst, "seq": seq, "arg": arg}})
+
+    # One row per sender/receiver pair with a span per message
+    pairs = set()
+    for (src, dst, mid), m in msgs.items():
+        if "queued" not in m or "delivered" not in m:
+            continue
+        tid = src * 256 + dst
+        pairs.add((src, dst))
+        out.append({"name": "msg #%d" % mid, "ph": "X", "pid": 1, "tid": tid,
+                    "ts": m["queued"], "dur": m["delivered"] - m["queued"],
+                    "args": {"frames": m["frames"], "retx": m["retx"],
+                             "drops": m["drops"]}})
+    for src, dst in pairs:
+        out.append({"name": "thread_name", "ph": "M", "pid": 1,
+                    "tid": src * 256 + dst,
+                    "args": {"name": "%d -> %d" % (src, dst)}})
+    out.append({"name": "process_name", "ph": "M", "pid": 0,
+                "args": {"name": "threads"}})
+    out.append({"name": "process_name", "ph": "M", "pid": 1,
+                "args": {"name": "messages"}})
+    with open(path, "w") as f:
+        json.dump({"traceEvents": out, "displayTimeUnit": "ms"}, f)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("trace")
+    parser.add_argument("--chrome", help="write Chrome trace JSON here")
+    parser.add_argument("--quiet", action="store_true",
+                        help="only print the stage percentiles")
+    args = parser.parse_args()
+
+    events, names, lost = load(args.trace)
+    if lost:
+        print("warning: %d records were lost to full trace buffers" % lost)
+    msgs = messages(events)
+    report(msgs, args.quiet)
+    if args.chrome:
+        chrome(events, names, msgs, args.chrome)
+
+
+if __name__ == "__main__":
+    main()
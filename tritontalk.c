@@ -0,0 +1,338 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "tritontalk.h"
+#include "arq.h"
+#include "communicate.h"
+#include "receiver.h"
+#include "sender.h"
+#include "util.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+// The globals common.h declares
+Sender* glb_senders_array;
+Receiver* glb_receivers_array;
+int glb_senders_array_length;
+int glb_receivers_array_length;
+SysConfig glb_sysconfig;
+int CORRUPTION_BITS;
+
+static pthread_t* sender_threads;
+static pthread_t* framer_threads;
+static pthread_t* receiver_threads;
+static bool started;
+
+// Public callbacks, handed to the endpoints as ctx of the trampolines below
+struct Tt_recv_hook_t {
+    TT_recv_callback on_data;
+    void* ctx;
+};
+struct Tt_sent_hook_t {
+    TT_sent_callback on_sent;
+    void* ctx;
+};
+static struct Tt_recv_hook_t recv_hooks[MAX_CLIENTS];
+static struct Tt_sent_hook_t sent_hooks[MAX_CLIENTS];
+
+void tt_default_config(SysConfig* config) {
+    memset(config, 0, sizeof(SysConfig));
+
+    // DO NOT CHANGE THIS
+    // Prepare the glb_sysconfig object
+    config->drop_prob = 0;
+    config->corrupt_prob = 0;
+    config->automated = 0;
+
+    // FEC is off unless a group size is given
+    config->fec_group_size = 0;
+    config->fec_parity_count = 1;
+
+    // Senders frame on a helper thread by default
+    config->pipelined = 1;
+
+    // Give in-flight data this long to be acked once input ends
+    config->drain_timeout = 5;
+
+    // Selective Repeat unless -mode says otherwise
+    config->arq_mode = arq_parse_mode("sr");
+
+    // Unframed commands a sender holds before callers have to wait
+    config->queue_cmds = 256;
+    config->queue_bytes = 1 << 20;
+
+    // Endpoint threads block right away and float across CPUs by default
+    config->spin_usec = 0;
+    config->pin_cpu = -1;
+
+    // Senders and receivers are separate hosts unless -duplex pairs them
+    config->duplex = false;
+
+    // Frames go out as soon as the window allows unless -pace is given
+    config->pace_rate = 0;
+
+    // One data link per sender; links without their own rates take -d and -c
+    config->link_count = 1;
+    for (int i = 0; i < MAX_LINKS; i++) {
+        config->link_drop[i] = -1;
+        config->link_corrupt[i] = -1;
+    }
+
+    // DO NOT CHANGE THIS
+    // Seed the psuedo random number generator
+    srand(time(NULL));
+    config->seed = time(NULL);
+}
+
+// Whether the config and endpoint counts can run, once glb_sysconfig holds it
+static bool tt_valid_config(int senders, int receivers) {
+    for (int i = 0; i < MAX_LINKS; i++) {
+        if (glb_sysconfig.link_drop[i] < 0 ||
+            glb_sysconfig.link_drop[i] > 1 ||
+            glb_sysconfig.link_corrupt[i] < 0 ||
+            glb_sysconfig.link_corrupt[i] > 1) {
+            return false;
+        }
+    }
+    return senders > 0 && receivers > 0 && senders <= MAX_CLIENTS &&
+           receivers <= MAX_CLIENTS &&
+           !(glb_sysconfig.drop_prob < 0 || glb_sysconfig.drop_prob > 1) &&
+           !(glb_sysconfig.corrupt_prob < 0 ||
+             glb_sysconfig.corrupt_prob > 1) &&
+           !(glb_sysconfig.fec_group_size < 0 ||
+             glb_sysconfig.fec_group_size > FEC_MAX_GROUP_SIZE) &&
+           !(glb_sysconfig.fec_parity_count < 1 ||
+             glb_sysconfig.fec_parity_count > FEC_MAX_PARITY) &&
+           glb_sysconfig.arq_mode >= 0 && glb_sysconfig.queue_cmds >= 1 &&
+           glb_sysconfig.queue_bytes >= 1 && glb_sysconfig.spin_usec >= 0 &&
+           glb_sysconfig.spin_usec <= 1000000 &&
+           glb_sysconfig.link_count >= 1 &&
+           glb_sysconfig.link_count <= MAX_LINKS &&
+           !(glb_sysconfig.duplex &&
+             (senders != receivers || !arq_policy()->acks)) &&
+           !(!arq_policy()->acks && glb_sysconfig.fec_group_size > 0);
+}
+
+// Create senders 0..senders-1 and receivers 0..receivers-1 with config.
+// Returns -1, and creates nothing, if the config cannot run.
+int tt_init(const SysConfig* config, int senders, int receivers) {
+    // DO NOT CHANGE THIS
+    // Set the number of bits to corrupt
+    CORRUPTION_BITS = (int) MAX_FRAME_SIZE / 2;
+
+    glb_sysconfig = *config;
+    for (int i = 0; i < MAX_LINKS; i++) {
+        if (glb_sysconfig.link_drop[i] < 0) {
+            glb_sysconfig.link_drop[i] = glb_sysconfig.drop_prob;
+        }
+        if (glb_sysconfig.link_corrupt[i] < 0) {
+            glb_sysconfig.link_corrupt[i] = glb_sysconfig.corrupt_prob;
+        }
+    }
+    if (!tt_valid_config(senders, receivers)) {
+        return -1;
+    }
+    glb_senders_array_length = senders;
+    glb_receivers_array_length = receivers;
+
+    // DO NOT CHANGE THIS
+    // Init the pthreads data structure
+    sender_threads = malloc(sizeof(pthread_t) * glb_senders_array_length);
+    assert(sender_threads);
+    framer_threads = malloc(sizeof(pthread_t) * glb_senders_array_length);
+    assert(framer_threads);
+    receiver_threads = malloc(sizeof(pthread_t) * glb_receivers_array_length);
+    assert(receiver_threads);
+
+    // Init the global senders array
+    glb_senders_array = malloc(glb_senders_array_length * sizeof(Sender));
+    assert(glb_senders_array);
+    glb_receivers_array = malloc(glb_receivers_array_length * sizeof(Receiver));
+    assert(glb_receivers_array);
+
+    channel_seed(glb_sysconfig.seed);
+    for (int i = 0; i < glb_senders_array_length; i++) {
+        init_sender(&glb_senders_array[i], i);
+    }
+    for (int i = 0; i < glb_receivers_array_length; i++) {
+        init_receiver(&glb_receivers_array[i], i);
+    }
+    return 0;
+}
+
+static void tt_recv_trampoline(Receiver* receiver, uint8_t src_id,
+                               uint8_t stream_id, const char* data,
+                               size_t length, bool is_last, void* ctx) {
+    struct Tt_recv_hook_t* hook = ctx;
+    hook->on_data(receiver->recv_id, src_id, stream_id, data, length, is_last,
+                  hook->ctx);
+}
+
+static void tt_sent_trampoline(Sender* sender, uint16_t dst_id, void* user,
+                               bool acked, void* ctx) {
+    struct Tt_sent_hook_t* hook = ctx;
+    hook->on_sent(sender->send_id, dst_id, user, acked, hook->ctx);
+}
+
+// -1 if recv_id is not a receiver of the current tt_init
+int tt_on_receive(int recv_id, TT_recv_callback on_data, void* ctx) {
+    if (glb_receivers_array == NULL || recv_id < 0 ||
+        recv_id >= glb_receivers_array_length || on_data == NULL) {
+        return -1;
+    }
+    recv_hooks[recv_id].on_data = on_data;
+    recv_hooks[recv_id].ctx = ctx;
+    receiver_set_callback(&glb_receivers_array[recv_id], tt_recv_trampoline,
+                          &recv_hooks[recv_id]);
+    return 0;
+}
+
+// Must come before tt_start, see sender_set_callback. -1 if send_id is not a
+// sender of the current tt_init.
+int tt_on_sent(int send_id, TT_sent_callback on_sent, void* ctx) {
+    if (glb_senders_array == NULL || send_id < 0 ||
+        send_id >= glb_senders_array_length || on_sent == NULL) {
+        return -1;
+    }
+    sent_hooks[send_id].on_sent = on_sent;
+    sent_hooks[send_id].ctx = ctx;
+    sender_set_callback(&glb_senders_array[send_id], tt_sent_trampoline,
+                        &sent_hooks[send_id]);
+    return 0;
+}
+
+static int tt_spawn(pthread_t* thread, void* (*run)(void*), void* endpoint) {
+    int rc = pthread_create(thread, NULL, run, endpoint);
+    if (rc) {
+        fprintf(stderr, "ERROR; return code from pthread_create() is %d\n", rc);
+    }
+    return rc;
+}
+
+// Spawn the sender, framer and receiver threads
+int tt_start() {
+    int i;
+    for (i = 0; i < glb_senders_array_length; i++) {
+        if (tt_spawn(sender_threads + i, run_sender,
+                     &glb_senders_array[i]) != 0) {
+            return -1;
+        }
+    }
+    for (i = 0; glb_sysconfig.pipelined && i < glb_senders_array_length; i++) {
+        if (tt_spawn(framer_threads + i, run_framer,
+                     &glb_senders_array[i]) != 0) {
+            return -1;
+        }
+    }
+    for (i = 0; i < glb_receivers_array_length; i++) {
+        if (tt_spawn(receiver_threads + i, run_receiver,
+                     &glb_receivers_array[i]) != 0) {
+            return -1;
+        }
+    }
+    started = true;
+    return 0;
+}
+
+// Queue a copy of buf for dst_id. Blocks while the sender is over its
+// queue_cmds/queue_bytes budget; -1 if the message is refused, in which case
+// on_sent never sees user.
+int tt_submit(int send_id, uint16_t dst_id, uint8_t stream_id,
+              const void* buf, size_t len, void* user) {
+    // An empty message would be dropped before framing and never complete
+    if (glb_senders_array == NULL || send_id < 0 ||
+        send_id >= glb_senders_array_length || len == 0) {
+        return -1;
+    }
+    return sender_submit(&glb_senders_array[send_id], dst_id, stream_id, buf,
+                         len, PRIO_NORMAL, user);
+}
+
+// Stop taking messages and wait, up to drain_timeout, for every sender to get
+// all of its frames acked. Returns how long that took in usec.
+static long tt_drain() {
+    struct timeval start, now;
+    long deadline = (long) (glb_sysconfig.drain_timeout * 1000000);
+    long usec;
+    int i;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < glb_senders_array_length; i++) {
+        sender_drain(&glb_senders_array[i]);
+    }
+
+    while (1) {
+        bool drained = true;
+        for (i = 0; i < glb_senders_array_length && drained; i++) {
+            Sender* sender = &glb_senders_array[i];
+            pthread_mutex_lock(&sender->buffer_mutex);
+            drained = sender_drained(sender);
+            pthread_mutex_unlock(&sender->buffer_mutex);
+        }
+        gettimeofday(&now, NULL);
+        usec = timeval_usecdiff(&start, &now);
+        if (drained || usec >= deadline) {
+            return usec;
+        }
+        struct timespec pause = {0, 1000000};
+        nanosleep(&pause, NULL);
+    }
+}
+
+// Drain, then stop every thread. Messages still pending reach on_sent as not
+// acked. Returns the drain time in usec.
+long tt_shutdown() {
+    long drain_usec = 0;
+    int i;
+
+    if (!started) {
+        return 0;
+    }
+    drain_usec = tt_drain();
+
+    // Threads notice stop at their next wakeup, so no thread is ever canceled
+    // while it holds a buffer_mutex
+    for (i = 0; i < glb_senders_array_length; i++) {
+        sender_stop(&glb_senders_array[i]);
+        pthread_join(sender_threads[i], NULL);
+        if (glb_sysconfig.pipelined) {
+            pthread_join(framer_threads[i], NULL);
+        }
+        sender_cancel_pending(&glb_senders_array[i]);
+    }
+
+    for (i = 0; i < glb_receivers_array_length; i++) {
+        receiver_stop(&glb_receivers_array[i]);
+        pthread_join(receiver_threads[i], NULL);
+    }
+    started = false;
+    return drain_usec;
+}
+
+// Shut down if still running and free every endpoint. tt_init may follow.
+void tt_destroy() {
+    int i;
+
+    tt_shutdown();
+    for (i = 0; i < glb_senders_array_length; i++) {
+        destroy_sender(&glb_senders_array[i]);
+    }
+    for (i = 0; i < glb_receivers_array_length; i++) {
+        destroy_receiver(&glb_receivers_array[i]);
+    }
+    free(sender_threads);
+    free(framer_threads);
+    free(receiver_threads);
+    free(glb_senders_array);
+    free(glb_receivers_array);
+    sender_threads = framer_threads = receiver_threads = NULL;
+    glb_senders_array = NULL;
+    glb_receivers_array = NULL;
+    glb_senders_array_length = 0;
+    glb_receivers_array_length = 0;
+}
@@ -0,0 +1,80 @@
+#ifndef __TRITONTALK_H__
+#define __TRITONTALK_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// libtritontalk: the senders, receivers and simulated channel without stdin
+// or the command line. A host program fills a SysConfig, creates the
+// endpoints, hooks its callbacks and hands over message buffers:
+//
+//   SysConfig config;
+//   tt_default_config(&config);
+//   config.drop_prob = 0.1;
+//   tt_init(&config, 1, 1);
+//   tt_on_receive(0, on_data, NULL);
+//   tt_on_sent(0, on_sent, NULL);
+//   tt_start();
+//   tt_submit(0, 0, 0, buf, len, buf);
+//   tt_shutdown();
+//   tt_destroy();
+//
+// Only one set of endpoints exists at a time, the one the tritontalk binary
+// drives too; after tt_destroy, tt_init may create the next. Callbacks run on
+// the endpoint threads with their buffer_mutex held, so they must not submit
+// from within. This header is all a host program needs; common.h and the
+// endpoint structs are internal.
+
+#define AUTOMATED_FILENAME 512
+
+// Parallel data links per sender, see communicate.c
+#define MAX_LINKS 4
+
+// System configuration information
+struct SysConfig_t {
+    float drop_prob;
+    float corrupt_prob;
+    unsigned char automated;
+    char automated_file[AUTOMATED_FILENAME];
+    int fec_group_size;
+    int fec_parity_count;
+    int pipelined;
+    unsigned long long seed; // channel impairment generators
+    float drain_timeout;     // seconds to wait for in-flight data at exit
+    int arq_mode;            // reliability policy, see arq.c
+    int queue_cmds;          // per-sender budget of unframed commands
+    size_t queue_bytes;      // and of their unframed bytes
+    int spin_usec;           // busy-poll budget of endpoint threads, 0 = off
+    int pin_cpu;             // first CPU endpoint threads are pinned to, or -1
+    bool duplex;             // sender i and receiver i form host i
+    int link_count;          // data links per sender, frames striped across
+    float link_drop[MAX_LINKS];    // per-link impairments, -d/-c by default
+    float link_corrupt[MAX_LINKS];
+    float pace_rate; // frames/s per destination, 0 = off, < 0 = estimated
+};
+typedef struct SysConfig_t SysConfig;
+
+// Payload for recv_id, in order within its stream, as soon as it arrives.
+// is_last ends a message; data is NULL when the rest of a message was lost
+// (datagram mode) and what was collected should be dropped.
+typedef void (*TT_recv_callback)(int recv_id, uint8_t src_id,
+                                 uint8_t stream_id, const char* data,
+                                 size_t length, bool is_last, void* ctx);
+
+// A message send_id accepted for dst_id is done: acked (or sent, in datagram
+// mode), or acked is false if it was still pending at tt_shutdown
+typedef void (*TT_sent_callback)(int send_id, uint16_t dst_id, void* user,
+                                 bool acked, void* ctx);
+
+void tt_default_config(SysConfig* config);
+int tt_init(const SysConfig* config, int senders, int receivers);
+int tt_on_receive(int recv_id, TT_recv_callback on_data, void* ctx);
+int tt_on_sent(int send_id, TT_sent_callback on_sent, void* ctx);
+int tt_start();
+int tt_submit(int send_id, uint16_t dst_id, uint8_t stream_id,
+              const void* buf, size_t len, void* user);
+long tt_shutdown();
+void tt_destroy();
+
+#endif
@@ -0,0 +1,171 @@
+#include "common.h"
+#include "receiver.h"
+#include "sender.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Checks of the window and sequence helpers that the end-to-end runs in
+// test.py only reach by chance. Sequence numbers run 1..255 and skip 0, so
+// the interesting cases straddle 255 -> 1.
+
+static int failures;
+
+#define CHECK(cond)                                                           \
+    do {                                                                      \
+        if (!(cond)) {                                                        \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond);                                                   \
+            failures++;                                                       \
+        }                                                                     \
+    } while (0)
+
+// A sender at the wrap point may only send the frames that fit its window,
+// counting 255 -> 1 as one step
+static void test_send_window_wrap() {
+    Sender* sender = calloc(1, sizeof(Sender));
+    glb_receivers_array_length = 1;
+    init_sender(sender, 0);
+    sender->cwnd[0] = WINDOW_SIZE - 1;
+    sender->LAR[0] = 252;
+
+    uint8_t inside[] = {253, 254, 255, 1, 2, 3, 4};
+    for (size_t i = 0; i < sizeof(inside); i++) {
+        CHECK(within_send_window(sender, 0, inside[i]));
+    }
+    CHECK(!within_send_window(sender, 0, 252));
+    CHECK(!within_send_window(sender, 0, 5));
+    CHECK(!within_send_window(sender, 0, 251));
+
+    // A smaller window stops earlier, still across the wrap
+    sender->cwnd[0] = 4;
+    CHECK(within_send_window(sender, 0, 1));
+    CHECK(!within_send_window(sender, 0, 2));
+    destroy_sender(sender);
+    free(sender);
+}
+
+// Hand one ack record for send_id 0 from receiver 0 to the sender
+static void deliver_ack(Sender* sender, uint8_t seq_num, uint8_t window) {
+    Ack* unit = ack_unit_alloc();
+    unit[0].src_id = 0;
+    unit[0].dst_id = 0;
+    unit[0].seq_num = seq_num;
+    unit[0].window = window;
+    ack_seal(&unit[0]);
+    ll_append_node(&sender->input_framelist_head, unit);
+    handle_incoming_acks(sender);
+}
+
+// An ack past the last frame sent is ignored, even inside the window
+static void test_ack_bound() {
+    Sender* sender = calloc(1, sizeof(Sender));
+    glb_receivers_array_length = 1;
+    init_sender(sender, 0);
+    sender->LAR[0] = 250;
+    sender->LFS[0] = 252;
+    sender->rwnd[0] = 5;
+
+    deliver_ack(sender, 254, 1);
+    CHECK(sender->LAR[0] == 250);
+    CHECK(sender->rwnd[0] == 5);
+    deliver_ack(sender, 0, 1);
+    CHECK(sender->rwnd[0] == 5);
+
+    // A repeated ack of LAR still updates the credits
+    deliver_ack(sender, 250, 3);
+    CHECK(sender->LAR[0] == 250);
+    CHECK(sender->rwnd[0] == 3);
+    CHECK(sender->input_framelist_head == NULL);
+    destroy_sender(sender);
+    free(sender);
+}
+
+static void test_within_window_wrap() {
+    CHECK(within_window(253, 252));
+    CHECK(within_window(4, 252));
+    CHECK(!within_window(5, 252));
+    CHECK(!within_window(252, 252));
+    CHECK(within_window(1, 255));
+    CHECK(within_window(7, 255));
+    CHECK(!within_window(8, 255));
+    // seq_num 0 is skipped, so it is never inside a window
+    CHECK(!within_window(0, 250));
+    CHECK(!within_window(0, 255));
+    CHECK(within_window(1, 0));
+}
+
+// Gap searches step from 255 to 1 like next_seq does
+static void test_bitmap_wrap() {
+    Seq_bitmap bitmap;
+    seq_bitmap_init(&bitmap);
+    CHECK(seq_bitmap_next_gap(&bitmap, 250) == 251);
+    CHECK(seq_bitmap_next_gap(&bitmap, 255) == 1);
+
+    uint8_t received[] = {251, 252, 253, 254, 255, 1, 2, 4};
+    for (size_t i = 0; i < sizeof(received); i++) {
+        seq_bitmap_set(&bitmap, received[i]);
+    }
+    CHECK(!seq_bitmap_test(&bitmap, 0));
+    CHECK(seq_bitmap_next_gap(&bitmap, 250) == 3);
+    CHECK(seq_bitmap_next_gap(&bitmap, 3) == 5);
+    CHECK(seq_bitmap_count(&bitmap) == 8);
+
+    // Clearing 250 -> 2 leaves only 4 behind
+    seq_bitmap_clear_range(&bitmap, 250, 2);
+    CHECK(seq_bitmap_count(&bitmap) == 1);
+    CHECK(seq_bitmap_test(&bitmap, 4));
+    CHECK(seq_bitmap_next_gap(&bitmap, 250) == 251);
+    seq_bitmap_clear_range(&bitmap, 3, 3);
+    CHECK(seq_bitmap_test(&bitmap, 4));
+
+    // With every seq_num set there is no gap
+    for (int seq = 1; seq <= UINT8_MAX; seq++) {
+        seq_bitmap_set(&bitmap, seq);
+    }
+    CHECK(seq_bitmap_next_gap(&bitmap, 250) == 250);
+    seq_bitmap_clear_range(&bitmap, 250, 5);
+    CHECK(seq_bitmap_next_gap(&bitmap, 6) == 251);
+    CHECK(seq_bitmap_count(&bitmap) == UINT8_MAX - 10);
+}
+
+// The LCA moves over everything received in a row, across 255 -> 1
+static void test_LCA_wrap() {
+    Receiver* receiver = calloc(1, sizeof(Receiver));
+    init_receiver(receiver, 0);
+    Seq_bitmap* recv_map = &receiver->recv_map[0];
+
+    CHECK(calc_LCA(receiver, 0, 0) == 0);
+    seq_bitmap_set(recv_map, 1);
+    seq_bitmap_set(recv_map, 2);
+    CHECK(calc_LCA(receiver, 0, 0) == 2);
+
+    seq_bitmap_init(recv_map);
+    CHECK(calc_LCA(receiver, 0, 250) == 250);
+    uint8_t received[] = {251, 252, 253, 254, 255, 1, 2, 4};
+    for (size_t i = 0; i < sizeof(received); i++) {
+        seq_bitmap_set(recv_map, received[i]);
+    }
+    CHECK(calc_LCA(receiver, 0, 250) == 2);
+    seq_bitmap_set(recv_map, 3);
+    CHECK(calc_LCA(receiver, 0, 250) == 4);
+    seq_bitmap_set(recv_map, 5);
+    CHECK(calc_LCA(receiver, 0, 250) == 5);
+    destroy_receiver(receiver);
+    free(receiver);
+}
+
+int main() {
+    test_send_window_wrap();
+    test_ack_bound();
+    test_within_window_wrap();
+    test_bitmap_wrap();
+    test_LCA_wrap();
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("unit tests ok\n");
+    return 0;
+}
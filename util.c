@@ -1,5 +1,107 @@
+#define _GNU_SOURCE
+
 #include "util.h"
+#include "perf.h"
+#include <sched.h>
 #include <stdint.h>
+#include <time.h>
+
+// Busy-poll slices between looks at the queue: short enough to notice a frame
+// within a microsecond or two, long enough not to hammer the mutex
+#define SPIN_PAUSES 16
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// How endpoint_wait calls ended with -spin: woken while polling, or blocked
+// on the condition variable after all
+static atomic_ulong spin_wakeups;
+static atomic_ulong spin_blocks;
+
+// On a single CPU the thread that would make ready() true cannot run while we
+// poll, so the poller has to hand the CPU over between looks
+static bool spin_yields;
+static pthread_once_t spin_yields_once = PTHREAD_ONCE_INIT;
+
+static void spin_yields_init() {
+    spin_yields = sysconf(_SC_NPROCESSORS_ONLN) <= 1;
+}
+
+static bool timespec_before(const struct timespec* a,
+                            const struct timespec* b) {
+    return a->tv_sec < b->tv_sec ||
+           (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// pthread_cond_timedwait, except that with -spin the caller first polls
+// ready(arg) for up to that many microseconds, dropping the mutex between
+// looks. A producer that finds nobody blocked on cv then skips the futex wake
+// and the poller skips the reschedule. Caller holds mutex.
+void endpoint_wait(pthread_cond_t* cv, pthread_mutex_t* mutex,
+                   const struct timespec* deadline, bool (*ready)(void*),
+                   void* arg) {
+    if (glb_sysconfig.spin_usec > 0) {
+        pthread_once(&spin_yields_once, spin_yields_init);
+        struct timespec now, spin_end;
+        clock_gettime(CLOCK_REALTIME, &now);
+        spin_end = now;
+        spin_end.tv_nsec += (long) glb_sysconfig.spin_usec * 1000;
+        spin_end.tv_sec += spin_end.tv_nsec / 1000000000;
+        spin_end.tv_nsec %= 1000000000;
+        if (timespec_before(deadline, &spin_end)) {
+            spin_end = *deadline;
+        }
+        while (timespec_before(&now, &spin_end)) {
+            pthread_mutex_unlock(mutex);
+            for (int i = 0; i < SPIN_PAUSES; i++) {
+                cpu_relax();
+            }
+            if (spin_yields) {
+                sched_yield();
+            }
+            pthread_mutex_lock(mutex);
+            if (ready(arg)) {
+                atomic_fetch_add_explicit(&spin_wakeups, 1,
+                                          memory_order_relaxed);
+                return;
+            }
+            clock_gettime(CLOCK_REALTIME, &now);
+        }
+        if (!timespec_before(&now, deadline)) {
+            return;
+        }
+        atomic_fetch_add_explicit(&spin_blocks, 1, memory_order_relaxed);
+    }
+    pthread_cond_timedwait(cv, mutex, deadline);
+}
+
+void endpoint_spin_stats(unsigned long* wakeups, unsigned long* blocks) {
+    *wakeups = atomic_load_explicit(&spin_wakeups, memory_order_relaxed);
+    *blocks = atomic_load_explicit(&spin_blocks, memory_order_relaxed);
+}
+
+// Pin the calling thread to CPU pin_cpu + slot, wrapping around the online
+// CPUs. Does nothing unless -pin was given.
+void pin_thread(int slot) {
+    if (glb_sysconfig.pin_cpu < 0) {
+        return;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int cpu = (glb_sysconfig.pin_cpu + slot) % (cpus > 0 ? cpus : 1);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0) {
+        fprintf(stderr, "Could not pin thread to CPU %d: %s\n", cpu,
+                strerror(rc));
+    }
+}
 
 // Linked list functions
 int ll_get_length(LLnode* head) {
@@ -82,6 +184,15 @@ void ll_destroy_node(LLnode* node) {
     free(node);
 }
 
+// Free every node of the list and the value it holds
+void ll_free_list(LLnode** head_ptr) {
+    while (*head_ptr != NULL) {
+        LLnode* node = ll_pop_node(head_ptr);
+        free(node->value);
+        free(node);
+    }
+}
+
 // Compute the difference in usec for two timeval objects
 long timeval_usecdiff(struct timeval* start_time, struct timeval* finish_time) {
     long usec;
@@ -90,51 +201,76 @@ long timeval_usecdiff(struct timeval* start_time, struct timeval* finish_time) {
     return usec;
 }
 
-// Print out messages entered by the user
-void print_cmd(Cmd* cmd) {
-    fprintf(stderr, "src=%d, dst=%d, message=%s\n", cmd->src_id, cmd->dst_id,
-            cmd->message);
+// Zeroed, cache line aligned frame. Channel buffers are allocated the same
+// way, so a frame is always a single aligned line.
+Frame* frame_alloc() {
+    Frame* frame = aligned_alloc(FRAME_ALIGNMENT, sizeof(Frame));
+    memset(frame, 0, sizeof(Frame));
+    return frame;
 }
 
-char* convert_frame_to_char(Frame* frame) {
-    char* char_buffer = malloc(sizeof(Frame));
-    memcpy(char_buffer, frame, sizeof(Frame));
-    return char_buffer;
+Frame* copy_frame(Frame* frame) {
+    Frame* new_frame = aligned_alloc(FRAME_ALIGNMENT, sizeof(Frame));
+    memcpy(new_frame, frame, sizeof(Frame));
+    return new_frame;
 }
 
-Frame* convert_char_to_frame(char* char_buf) {
-    Frame* frame = malloc(sizeof(Frame));
-    memcpy(frame, char_buf, sizeof(Frame));
-    return frame;
+// Compute the crc over the header and payload and store it big-endian
+void frame_seal(Frame* frame) {
+    uint32_t crc = compute_crc((char*) frame, offsetof(Frame, crc));
+    frame->crc[0] = crc >> 24;
+    frame->crc[1] = crc >> 16;
+    frame->crc[2] = crc >> 8;
+    frame->crc[3] = crc;
 }
 
-Frame* copy_frame(Frame* frame) {
-    Frame* new_frame = malloc(sizeof(Frame));
-    memcpy(new_frame, (char*) frame, sizeof(Frame));
-    return (Frame*) new_frame;
+bool frame_crc_ok(Frame* frame) {
+    uint32_t crc = compute_crc((char*) frame, offsetof(Frame, crc));
+    return frame->crc[0] == (uint8_t) (crc >> 24) &&
+           frame->crc[1] == (uint8_t) (crc >> 16) &&
+           frame->crc[2] == (uint8_t) (crc >> 8) &&
+           frame->crc[3] == (uint8_t) crc;
 }
 
-int checksum(Frame* frame) {
-    int sum = 0;
-    char* data = convert_frame_to_char(frame);
-    for (int i = 0; i < MAX_FRAME_SIZE - 8; i++) {
-        sum += (int) data[i];
-    }
-    free(data);
-    return sum;
+// Seal an ack record, see Ack. ACK_CRC_XOR keeps unused, all-zero records
+// from passing, also once the channel has flipped some of their bytes.
+void ack_seal(Ack* ack) {
+    uint16_t crc = compute_crc((char*) ack, offsetof(Ack, crc)) ^ ACK_CRC_XOR;
+    ack->crc[0] = crc >> 8;
+    ack->crc[1] = crc;
 }
 
-bool within_window(uint8_t seq_num, uint8_t LAR) {
-    if (seq_num == LAR) {
-        return false;
-    }
-    if (seq_num >= LAR) {
-        return seq_num - LAR < WINDOW_SIZE;
+bool ack_crc_ok(const Ack* ack) {
+    uint16_t crc =
+        compute_crc((const char*) ack, offsetof(Ack, crc)) ^ ACK_CRC_XOR;
+    return ack->crc[0] == (uint8_t) (crc >> 8) && ack->crc[1] == (uint8_t) crc;
+}
+
+// An empty channel unit for up to ACKS_PER_UNIT ack records
+Ack* ack_unit_alloc() {
+    return (Ack*) frame_alloc();
+}
+
+// Put a frame into a fresh channel buffer, which send_frame takes ownership of
+char* frame_encode(Frame* frame) {
+    return (char*) copy_frame(frame);
+}
+
+// Number of next_seq steps from one sequence number to another
+int seq_distance(uint8_t from, uint8_t to) {
+    if (to >= from) {
+        return to - from;
     } else {
-        return (UINT8_MAX - LAR) + seq_num < WINDOW_SIZE;
+        return (UINT8_MAX - from) + to;
     }
 }
 
+// seq_num 0 is never sent, but seq_distance counts it as one step past 255
+bool within_window(uint8_t seq_num, uint8_t LAR) {
+    int distance = seq_distance(LAR, seq_num);
+    return seq_num != 0 && distance > 0 && distance < WINDOW_SIZE;
+}
+
 uint8_t next_seq(uint8_t seq_num) {
     if (seq_num == UINT8_MAX) {
         return 1;
@@ -151,36 +287,207 @@ uint8_t prev_seq(uint8_t seq_num) {
     }
 }
 
-uint8_t max_seq(uint8_t a, uint8_t b) {
-    uint8_t diff = a > b ? a - b : b - a;
-    if (diff > WINDOW_SIZE) {
-        return a > b ? b : a;
-    }
-    return a > b ? a : b;
-}
-
-unsigned int compute_crc(Frame* frame) {
-    const unsigned int polynomial = 0x04C11DB7; /* divisor is 32bit */
-    unsigned int crc = 0;                       /* CRC value is 32bit */
-    const data_size = MAX_FRAME_SIZE - 4;
-    char bytes[data_size];
-
-    memcpy(bytes, frame, sizeof(char) * data_size);
+static uint32_t crc_lookup[256];
+static pthread_once_t crc_lookup_once = PTHREAD_ONCE_INIT;
 
-    // Byte Loop
-    for (int i = 0; i < data_size; i++) {
-        char b = bytes[i];
-        crc ^= (unsigned int) (b << 24);
+static void crc_lookup_init() {
+    const uint32_t polynomial = 0x04C11DB7; /* divisor is 32bit */
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = (uint32_t) i << 24;
         // Bit Loop
-        for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
             if ((crc & 0x80000000) != 0) /* test for MSB = bit 31 */
             {
-                crc = (unsigned int) ((crc << 1) ^ polynomial);
+                crc = (crc << 1) ^ polynomial;
             } else {
                 crc <<= 1;
             }
         }
+        crc_lookup[i] = crc;
     }
+}
+
+// Byte-at-a-time lookup table for compute_crc and the batch kernels
+const uint32_t* crc_table() {
+    pthread_once(&crc_lookup_once, crc_lookup_init);
+    return crc_lookup;
+}
+
+// The CRC of any buffer, outside the -perf counts. Whole files go through
+// here so they do not show up as one giant frame in PERF_CRC.
+uint32_t crc_buffer(const char* buf, size_t length) {
+    const uint32_t* table = crc_table();
+    uint32_t crc = 0; /* CRC value is 32bit */
 
+    for (size_t i = 0; i < length; i++) {
+        uint8_t b = buf[i];
+        crc = (crc << 8) ^ table[(crc >> 24) ^ b];
+    }
     return crc;
 }
+
+// The CRC of one frame or ack record, counted under PERF_CRC
+uint32_t compute_crc(const char* buf, size_t length) {
+    Perf_sample sample;
+    perf_begin(&sample);
+    uint32_t crc = crc_buffer(buf, length);
+    perf_end(PERF_CRC, &sample, 1);
+    return crc;
+}
+
+static uint64_t splitmix64(uint64_t* x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Expand a 64-bit seed into the full xoshiro state, as its authors recommend
+void rng_seed(Rng* rng, uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        rng->s[i] = splitmix64(&seed);
+    }
+}
+
+static uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+// xoshiro256**. Not thread safe, every thread owns its own Rng.
+uint64_t rng_next(Rng* rng) {
+    uint64_t* s = rng->s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return result;
+}
+
+void seq_bitmap_init(Seq_bitmap* bitmap) {
+    memset(bitmap, 0, sizeof(Seq_bitmap));
+}
+
+void seq_bitmap_set(Seq_bitmap* bitmap, uint8_t seq_num) {
+    bitmap->words[seq_num / 64] |= (uint64_t) 1 << (seq_num % 64);
+}
+
+void seq_bitmap_clear(Seq_bitmap* bitmap, uint8_t seq_num) {
+    bitmap->words[seq_num / 64] &= ~((uint64_t) 1 << (seq_num % 64));
+}
+
+bool seq_bitmap_test(Seq_bitmap* bitmap, uint8_t seq_num) {
+    return (bitmap->words[seq_num / 64] >> (seq_num % 64)) & 1;
+}
+
+// Mask of bits lo..hi (inclusive) within one word
+static uint64_t word_span(int lo, int hi) {
+    uint64_t upper = hi == 63 ? ~(uint64_t) 0 : ((uint64_t) 1 << (hi + 1)) - 1;
+    return upper & ~(((uint64_t) 1 << lo) - 1);
+}
+
+static void seq_bitmap_clear_span(Seq_bitmap* bitmap, int lo, int hi) {
+    for (int w = lo / 64; w <= hi / 64; w++) {
+        int from = w == lo / 64 ? lo % 64 : 0;
+        int to = w == hi / 64 ? hi % 64 : 63;
+        bitmap->words[w] &= ~word_span(from, to);
+    }
+}
+
+// Clear every seq_num following after, up to and including last, in next_seq
+// order. Does nothing when last == after.
+void seq_bitmap_clear_range(Seq_bitmap* bitmap, uint8_t after, uint8_t last) {
+    if (last == after) {
+        return;
+    }
+    uint8_t first = next_seq(after);
+    if (first <= last) {
+        seq_bitmap_clear_span(bitmap, first, last);
+    } else {
+        seq_bitmap_clear_span(bitmap, first, UINT8_MAX);
+        seq_bitmap_clear_span(bitmap, 1, last);
+    }
+}
+
+// First seq_num following after, in next_seq order, whose bit is clear. Each
+// word is inverted so the gap is its lowest set bit. Returns after itself when
+// every other seq_num is set.
+uint8_t seq_bitmap_next_gap(Seq_bitmap* bitmap, uint8_t after) {
+    int start = next_seq(after);
+    int w = start / 64;
+    uint64_t below = ((uint64_t) 1 << (start % 64)) - 1;
+
+    for (int n = 0; n <= SEQ_BITMAP_WORDS; n++) {
+        uint64_t word = bitmap->words[w];
+        if (w == 0) {
+            word |= 1; // seq_num 0
+        }
+        // Bits in front of start are only searched after wrapping around
+        if (n == 0) {
+            word |= below;
+        } else if (n == SEQ_BITMAP_WORDS) {
+            word |= ~below;
+        }
+        uint64_t gaps = ~word;
+        if (gaps != 0) {
+            return w * 64 + __builtin_ctzll(gaps);
+        }
+        w = (w + 1) % SEQ_BITMAP_WORDS;
+    }
+    return after;
+}
+
+int seq_bitmap_count(Seq_bitmap* bitmap) {
+    int count = 0;
+    for (int w = 0; w < SEQ_BITMAP_WORDS; w++) {
+        count += __builtin_popcountll(bitmap->words[w]);
+    }
+    return count;
+}
+
+void ring_init(Frame_ring* ring) {
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+}
+
+size_t ring_count(Frame_ring* ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return tail - head;
+}
+
+// Producer side, returns false if the ring is full
+bool ring_push(Frame_ring* ring, Frame* frame) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == FRAME_RING_SIZE) {
+        return false;
+    }
+    ring->slots[tail & (FRAME_RING_SIZE - 1)] = frame;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+// Consumer side, returns NULL if the ring is empty
+Frame* ring_peek(Frame_ring* ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail) {
+        return NULL;
+    }
+    return ring->slots[head & (FRAME_RING_SIZE - 1)];
+}
+
+Frame* ring_pop(Frame_ring* ring) {
+    Frame* frame = ring_peek(ring);
+    if (frame != NULL) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    }
+    return frame;
+}
@@ -19,25 +19,56 @@ int ll_get_length(LLnode*);
 void ll_append_node(LLnode**, void*);
 LLnode* ll_pop_node(LLnode**);
 void ll_destroy_node(LLnode*);
-
-// Print functions
-void print_cmd(Cmd*);
+void ll_free_list(LLnode** head_ptr);
 
 // Time functions
 long timeval_usecdiff(struct timeval*, struct timeval*);
 
-char* convert_frame_to_char(Frame*);
-Frame* convert_char_to_frame(char*);
+// Endpoint threads
+void endpoint_wait(pthread_cond_t* cv, pthread_mutex_t* mutex,
+                   const struct timespec* deadline, bool (*ready)(void*),
+                   void* arg);
+void endpoint_spin_stats(unsigned long* wakeups, unsigned long* blocks);
+void pin_thread(int slot);
 
-int checksum(Frame* frame);
+// Wire format
+Frame* frame_alloc();
+void frame_seal(Frame* frame);
+bool frame_crc_ok(Frame* frame);
+char* frame_encode(Frame* frame);
+void ack_seal(Ack* ack);
+bool ack_crc_ok(const Ack* ack);
+Ack* ack_unit_alloc();
 
 Frame* copy_frame(Frame* frame);
 
+int seq_distance(uint8_t from, uint8_t to);
 bool within_window(uint8_t seq_num, uint8_t LAR);
 
 uint8_t next_seq(uint8_t seq_num);
 uint8_t prev_seq(uint8_t seq_num);
-uint8_t max_seq(uint8_t a, uint8_t b);
 
-unsigned int compute_crc(Frame* frame);
+// Pseudo random numbers
+void rng_seed(Rng* rng, uint64_t seed);
+uint64_t rng_next(Rng* rng);
+
+// Sequence number bitmaps
+void seq_bitmap_init(Seq_bitmap* bitmap);
+void seq_bitmap_set(Seq_bitmap* bitmap, uint8_t seq_num);
+void seq_bitmap_clear(Seq_bitmap* bitmap, uint8_t seq_num);
+bool seq_bitmap_test(Seq_bitmap* bitmap, uint8_t seq_num);
+void seq_bitmap_clear_range(Seq_bitmap* bitmap, uint8_t after, uint8_t last);
+uint8_t seq_bitmap_next_gap(Seq_bitmap* bitmap, uint8_t after);
+int seq_bitmap_count(Seq_bitmap* bitmap);
+
+const uint32_t* crc_table();
+uint32_t crc_buffer(const char* buf, size_t length);
+uint32_t compute_crc(const char* buf, size_t length);
+
+// Lock-free single producer, single consumer frame queue
+void ring_init(Frame_ring* ring);
+size_t ring_count(Frame_ring* ring);
+bool ring_push(Frame_ring* ring, Frame* frame);
+Frame* ring_peek(Frame_ring* ring);
+Frame* ring_pop(Frame_ring* ring);
 #endif